@@ -10,26 +10,37 @@
 #define ROO_LAGRANGIAN_MORPH_LC
 #include <limits>
 
-#ifdef USE_UBLAS
 #include <vector>
 #include <list>
 #include <ostream>
 
-#include <boost/multiprecision/cpp_dec_float.hpp>
-
 #include "RooListProxy.h"
 #include "RooAbsReal.h"
 #include "RooArgSet.h"
 
+#ifdef USE_UBLAS
+#include <boost/multiprecision/cpp_dec_float.hpp>
 
 namespace RooLagrangianMorphing {
   typedef boost::multiprecision::number<boost::multiprecision::cpp_dec_float<100> > SuperFloat;
   typedef std::numeric_limits< SuperFloat > SuperFloatPrecision;
+}
+#else
+namespace RooLagrangianMorphing {
+   typedef double SuperFloat;
+   typedef std::numeric_limits<double> SuperFloatPrecision;
+}
+#endif
 
+namespace RooLagrangianMorphing {
   class LinearCombination : public RooAbsReal {
     RooListProxy _actualVars ;
     std::vector<SuperFloat> _coefficients;
     mutable RooArgSet* _nset; //!
+    mutable std::vector<double> _coefficientsHi; //!
+    mutable std::vector<double> _coefficientsLo; //!
+    mutable std::vector<std::size_t> _nonZero; //!
+    void splitCoefficients() const;
 
   public:
     LinearCombination();
@@ -41,6 +52,7 @@ namespace RooLagrangianMorphing {
     void add(SuperFloat c,RooAbsReal* t);
     void setCoefficient(size_t idx,SuperFloat c);
     SuperFloat getCoefficient(size_t idx);
+    std::size_t getMemorySize() const;
     virtual Double_t evaluate() const override;    
     virtual std::list<Double_t>* binBoundaries(RooAbsRealLValue& obs, Double_t xlo, Double_t xhi) const override;
     virtual std::list<Double_t>* plotSamplingHint(RooAbsRealLValue& obs, Double_t xlo, Double_t xhi) const override;
@@ -50,11 +62,4 @@ namespace RooLagrangianMorphing {
   };
 }
 
-#else
-namespace RooLagrangianMorphing {
-   typedef double SuperFloat;
-   typedef std::numeric_limits<double> SuperFloatPrecision;
-}
-#endif
-
 #endif
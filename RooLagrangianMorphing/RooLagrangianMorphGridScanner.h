@@ -0,0 +1,75 @@
+/* -*- mode: c++ -*- *********************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * authors:                                                                  *
+ *  Lydia Brenner (lbrenner@cern.ch), Carsten Burgard (cburgard@cern.ch)     *
+ *  Katharina Ecker (kecker@cern.ch), Adam Kaluza      (akaluza@cern.ch)     *
+ *****************************************************************************/
+
+
+#ifndef ROO_LAGRANGIAN_MORPHING_GRIDSCANNER
+#define ROO_LAGRANGIAN_MORPHING_GRIDSCANNER
+
+#include "RooLagrangianMorphing.h"
+#include <functional>
+#include <vector>
+#include <string>
+
+class RooLagrangianMorphGridScanner {
+public:
+  typedef RooLagrangianMorphing::ParamSet ParamSet;
+
+  RooLagrangianMorphGridScanner(RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsReal>* func);
+  RooLagrangianMorphGridScanner(RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsPdf>* func);
+  virtual ~RooLagrangianMorphGridScanner();
+
+  void addAxis(const char* name, int n, double min, double max);
+  void setPoints(const std::vector<ParamSet>& points);
+  void setNumThreads(int n);
+  void setChunkSize(size_t n);
+  void setStoreErrors(bool store);
+
+  size_t nPoints() const;
+  size_t nBins() const;
+  ParamSet getPoint(size_t i) const;
+
+  void writeBinary(const char* filename);
+  void writeTree(const char* filename, const char* treename = "grid");
+
+protected:
+  class Axis {
+  public:
+    std::string name;
+    int n;
+    double min;
+    double max;
+    Axis(const std::string& nm, int nbins, double lo, double hi) :
+      name(nm), n(nbins), min(lo), max(hi)
+    {}
+  };
+  typedef std::function<void(size_t npoints, const double* params, const double* contents, const double* errors)> Sink;
+
+  void setup();
+  std::vector<std::string> parameterNames() const;
+  void scan(const Sink& sink);
+
+  std::function<void(const ParamSet&)> fSetParameters; //!
+  std::function<ParamSet()> fGetParameters; //!
+  std::function<std::vector<double>()> fGetWeights; //!
+  std::function<std::vector<std::vector<double> >(bool)> fGetTemplates; //!
+  bool fAllowNegativeYields = true;
+
+  std::vector<Axis> fAxes;
+  std::vector<ParamSet> fPoints;
+  int fNumThreads = 0;
+  size_t fChunkSize = 1024;
+  bool fStoreErrors = true;
+
+  // flattened sample templates, one row of nbins per sample
+  size_t fNSamples = 0;
+  size_t fNBins = 0;
+  std::vector<double> fTemplates;
+  std::vector<double> fErrors2;
+};
+
+#endif
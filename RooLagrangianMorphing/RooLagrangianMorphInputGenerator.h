@@ -0,0 +1,71 @@
+/* -*- mode: c++ -*- *********************************************************
+ * Project: RooFit                                                           *
+ *                                                                           *
+ * authors:                                                                  *
+ *  Lydia Brenner (lbrenner@cern.ch), Carsten Burgard (cburgard@cern.ch)     *
+ *  Katharina Ecker (kecker@cern.ch), Adam Kaluza      (akaluza@cern.ch)     *
+ *****************************************************************************/
+
+
+#ifndef ROO_LAGRANGIAN_MORPHING_INPUTGENERATOR
+#define ROO_LAGRANGIAN_MORPHING_INPUTGENERATOR
+
+#include "RooLagrangianMorphing.h"
+#include <map>
+#include <random>
+#include <vector>
+#include <string>
+
+class TDirectory;
+class TFolder;
+class TH1;
+
+class RooLagrangianMorphInputGenerator {
+public:
+  typedef RooLagrangianMorphing::ParamSet ParamSet;
+  typedef RooLagrangianMorphing::FlagSet FlagSet;
+  typedef RooLagrangianMorphing::ParamMap ParamMap;
+  typedef RooLagrangianMorphing::FlagMap FlagMap;
+
+  RooLagrangianMorphInputGenerator(const std::vector<RooArgList*>& vertices, int nbins, unsigned long long seed = 0);
+  RooLagrangianMorphInputGenerator(const RooAbsCollection& prodCouplings, const RooAbsCollection& decCouplings, int nbins, unsigned long long seed = 0);
+  virtual ~RooLagrangianMorphInputGenerator();
+
+  void setRange(double min, double max);
+  void setRange(const char* name, double min, double max);
+  void fixParameter(const char* name, double value);
+  void setNormalization(double norm);
+
+  size_t nSamples();
+  size_t nBins() const;
+  const RooArgList& getOperators() const;
+
+  ParamMap generateParamCards(size_t n = 0, const char* prefix = "s");
+  std::vector<double> truth(const ParamSet& params) const;
+  TH1* createTruthTH1(const ParamSet& params, const char* name) const;
+  TFolder* makeSampleFolder(const std::string& name, const ParamSet& params, const char* obsName, const FlagSet* flags = NULL) const;
+  void write(TDirectory* dir, const ParamMap& samples, const char* obsName, const FlagMap& flags = FlagMap()) const;
+  void write(const char* filename, const ParamMap& samples, const char* obsName, const FlagMap& flags = FlagMap()) const;
+
+protected:
+  void setup(int nbins, unsigned long long seed);
+  void setOperators(const ParamSet& params) const;
+
+  std::vector<RooArgList> fVertices;
+  RooArgList fCouplings;
+  RooArgList fOperators;
+
+  // amplitudes of the couplings, one row of nbins per coupling and vertex
+  std::vector<std::vector<double> > fAmplitudes;
+  std::vector<double> fShape;
+  size_t fNBins = 0;
+  double fNormalization = 1000.;
+  std::mt19937_64 fEngine; //!
+
+  double fMin = -2.;
+  double fMax = 2.;
+  std::map<std::string,std::pair<double,double> > fRanges;
+  ParamSet fFixed;
+};
+
+#endif
@@ -12,10 +12,14 @@
 
 #include "RooLagrangianMorphing.h"
 #include <map>
+#include <random>
+#include <iosfwd>
 
 class TMinuit;
 class TClass;
 class TFolder;
+class TGraph;
+class TH2;
 
 class RooLagrangianMorphOptimizer {
 
@@ -32,27 +36,50 @@ public:
   class RandomLagrangianGenerator;
   class RandomCouplingGenerator {
     double fLower; double fUpper;
+    mutable std::mt19937_64 fEngine; //!
     friend RandomLagrangianGenerator;
   public:
-    RandomCouplingGenerator(double low, double high);
+    RandomCouplingGenerator(double low, double high, unsigned long long seed = 0, unsigned long long stream = 0);
     double generate() const;
+    double transform(double u) const;
   };
   
   class RandomLagrangianGenerator {
+  public:
+    enum Mode { Uniform, Sobol, LatinHypercube };
+  protected:
     std::map<const std::string, const RandomCouplingGenerator> fCouplings;
+    std::mt19937_64 fEngine; //!
+    unsigned long long fSeed = 0;
+    unsigned long long fStream = 0;
+    Mode fMode = Uniform;
+    unsigned long long fIndex = 0;
+    std::vector<unsigned int> fSobolState;
+    std::vector<unsigned int> fSobolShift;
+    std::vector<unsigned int> fSobolDirections;
+    std::vector<double> nextUnitPoint();
+    void seedCouplings();
   public:
+    RandomLagrangianGenerator(unsigned long long seed = 0, unsigned long long stream = 0, Mode mode = Uniform);
+    void setSeed(unsigned long long seed, unsigned long long stream = 0);
+    void setMode(Mode mode);
     void addCoupling(const std::string& name, double min, double max);
     RooLagrangianMorphOptimizer::ParamCard generate();
+    std::vector<RooLagrangianMorphOptimizer::ParamCard> generate(size_t n);
     void print();
   };
     
   class Evaluator {
   public:
     virtual double operator() (double val_morphed, double unc_morphed, double val_benchmark, double unc_benchmark) = 0;
+    virtual void gradient(double val_morphed, double unc_morphed, double val_benchmark, double unc_benchmark, double& dval, double& dunc);
   };
 protected:
   Evaluator* evaluator = NULL;
   double presetUncertainty = 0;
+  bool useGradient = true;
+  double conditionWeight = 0.;
+  double conditionThreshold = 0.;
 
   class Benchmark {
   public:
@@ -70,8 +97,18 @@ public:
   virtual ~RooLagrangianMorphOptimizer();
 
   void setEvaluator(Evaluator* eval, double presetUncertainty = 0);
+  void setUseGradient(bool use);
+  void setConditionPenalty(double weight, double threshold = 0.);
+  std::vector<double> getGradient();
   int optimize();
+  void setCheckpoint(const char* filename, int every = 100);
+  void writeCheckpoint(const char* filename);
+  bool resume(const char* filename);
+  void setLog(const char* filename);
+  void setNumThreads(int n);
+  std::vector<double> scan(const std::vector<std::vector<double> >& points);
   TGraph* makeLikelihoodGraph(const int& sample, const TString& , const int n = 1000, const double modus = 0.);
+  TH2* makeLikelihoodHistogram(const int& sampleX, const TString& parameterX, const int& sampleY, const TString& parameterY, const int nx = 100, const int ny = 100, const double modus = 0.);
   double evaluate(const ParamCardSet& pcset, double& condition, double& l2norm);
   double evaluate(const ParamCardSet& pcset);
 
@@ -96,9 +133,14 @@ protected:
   void setup(const ParamCardSet& startvalues);
   void cloneFileContents(const TString& filename, bool addbenchmarks);
   std::vector<double> getParameterBounds(const std::vector<double>& pars);
+  int getParameterIndex(const int& sample, const TString& parametername);
+  void getScanRange(const int& sample, const TString& parametername, const double modus, double& min, double& max);
   void printResult(const std::vector<Double_t>&par,Double_t&score);
+  void logIteration(double fcnTime, double setupTime, double buildTime, double inversionTime, double score);
   double testMorphing();
   void setupMorphing(const std::vector<double>& par);
+  double prescreen(const std::vector<double>& par);
+  void computeGradient(const std::vector<double>& pars, const std::vector<double>& pars_limit, double score, double* grad);
   void setupMorphFunc();
 
 protected:
@@ -123,6 +165,8 @@ protected:
   std::vector<RooArgList> vertices;
   
   std::vector<Benchmark> benchmarks;
+  std::vector<double> sampleXS;
+  std::vector<double> sampleXSUnc;
 
   std::vector<TString> temporaries;
   
@@ -135,6 +179,15 @@ protected:
   std::map<const int, std::vector<std::string>> parameternames; // sample, parameternames
 
   int iterations = 0;
+  int nThreads = 0;
+  std::vector<double> bestPars;
+  TString stage;
+
+  // checkpointing and telemetry
+  TString checkpointfilename;
+  int checkpointInterval = 100;
+  std::ofstream* fcnLog = NULL; //!
+  double startTime = 0.;
   std::vector<std::string> xsInputs;
   double bestScore;
 
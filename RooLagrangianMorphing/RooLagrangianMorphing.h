@@ -25,9 +25,11 @@ class TPair;
 class TFolder;
 
 #include <vector>
+#include <set>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 namespace RooLagrangianMorphing {
   typedef std::map<const std::string,double> ParamSet;
@@ -35,8 +37,46 @@ namespace RooLagrangianMorphing {
   typedef std::map<const std::string,RooLagrangianMorphing::ParamSet > ParamMap;
   typedef std::map<const std::string,RooLagrangianMorphing::FlagSet > FlagMap;  
   extern bool gAllowExceptions;
+  enum Precision { DefaultPrecision, DoublePrecision, LongDoublePrecision, DoubleDoublePrecision, QuadPrecision, MultiPrecision };
+  extern Precision gInversionPrecision;
+  extern Precision gEvaluationPrecision;
+  extern bool gEquilibrate;
+  extern bool gLeastSquares;
+  struct PrecisionReport {
+    Precision precision;
+    double inversionTime;
+    double inversionDeviation;
+    double evaluationTime;
+    double evaluationDeviation;
+  };
+  bool isPrecisionAvailable(Precision precision);
+  const char* getPrecisionName(Precision precision);
+  enum Phase { CachePhase, ComponentsPhase, FormulasPhase, MatrixFillPhase, InversionPhase, SanityPhase, MorphingFunctionPhase, TemplatesPhase, NPhases };
+  struct Statistics {
+    double phaseTime[NPhases] = {};
+    unsigned long long phaseCalls[NPhases] = {};
+    unsigned long long evaluations = 0;
+    unsigned long long recomputations = 0;
+    unsigned long long cacheBuilds = 0;
+  };
+  const char* getPhaseName(Phase phase);
+  const Statistics& getGlobalStatistics();
+  void resetGlobalStatistics();
+  void writeStatistics(const Statistics& statistics, std::ostream& stream);
+  enum MemoryCategory { TemplateMemory, TemplateTableMemory, MatrixMemory, ProductMemory, ConstVarMemory, LinearCombinationMemory, OtherNodeMemory, NMemoryCategories };
+  struct MemoryReport {
+    unsigned long long bytes[NMemoryCategories] = {};
+    unsigned long long objects[NMemoryCategories] = {};
+    unsigned long long instances = 0;
+  };
+  const char* getMemoryCategoryName(MemoryCategory category);
+  MemoryReport getGlobalMemoryReport();
+  void writeMemoryReport(const MemoryReport& report, std::ostream& stream);
+  void printMemoryReport(const MemoryReport& report);
+  class WeightEngine;
+  class SharedCache;
   double implementedPrecision();
-  RooWorkspace* makeCleanWorkspace(RooWorkspace* oldWS, const char* newName = 0, const char* mcname = "ModelConfig", bool keepData = false);
+  RooWorkspace* makeCleanWorkspace(RooWorkspace* oldWS, const char* newName = 0, const char* mcname = "ModelConfig", bool keepData = false, bool prune = false);
   void importToWorkspace(RooWorkspace* ws, const RooAbsReal* object);
   void importToWorkspace(RooWorkspace* ws, RooAbsData* object);  
   
@@ -60,9 +100,14 @@ namespace RooLagrangianMorphing {
   void writeMatrixToStream(const TMatrixD& matrix, std::ostream& stream);
   TMatrixD readMatrixFromFile(const char* fname);
   TMatrixD readMatrixFromStream(std::istream& stream);
+  double estimateCondition(const TMatrixD& matrix, double* logdet = NULL);
+  double estimateCondition(const std::vector<double>& matrix, size_t n, double* logdet = NULL);
+  bool invertFlatMatrix(const std::vector<double>& matrix, size_t n, std::vector<double>& inverse, double* unityDeviation = NULL);
 
   RooDataHist* makeDataHistogram(TH1* hist, RooRealVar* observable, const char* histname = NULL);
   void setDataHistogram(TH1* hist, RooRealVar* observable, RooDataHist* dh);
+  RooDataHist* makeDataHistogram(TObject* hist, const RooArgList& observables, const char* histname = NULL);
+  void setDataHistogram(TObject* hist, RooDataHist* dh);
   void printDataHistogram(RooDataHist* hist, RooRealVar* obs);
 
   int countSamples(std::vector<RooArgList*>& vertices);
@@ -71,6 +116,8 @@ namespace RooLagrangianMorphing {
   TPair* makeCrosssectionContainer(double xs, double unc);
   RooArgSet createWeights(const RooLagrangianMorphing::ParamMap& inputs, const std::vector<RooArgList*>& vertices, RooArgList& couplings, const RooLagrangianMorphing::FlagMap& inputFlags, const RooArgList& flags, const std::vector<RooArgList*>& nonInterfering);
   RooArgSet createWeights(const RooLagrangianMorphing::ParamMap& inputs, const std::vector<RooArgList*>& vertices, RooArgList& couplings);
+  std::vector<std::string> selectSamples(const RooLagrangianMorphing::ParamMap& pool, const std::vector<RooArgList*>& vertices, RooArgList& couplings, const RooLagrangianMorphing::FlagMap& inputFlags, const RooArgList& flags, const std::vector<RooArgList*>& nonInterfering);
+  std::vector<std::string> selectSamples(const RooLagrangianMorphing::ParamMap& pool, const std::vector<RooArgList*>& vertices, RooArgList& couplings);
 
   // some helpers to make the template mapping work
   template<class Base> struct Internal;
@@ -140,6 +187,7 @@ namespace RooLagrangianMorphing {
     int nParameters() const;
     int nSamples() const;
     int nPolynomials() const;
+    int nBins() const;
 
     bool isCouplingUsed(const char* couplname) const;
     const RooArgList* getCouplingSet() const;
@@ -148,11 +196,30 @@ namespace RooLagrangianMorphing {
     TMatrixD getMatrix() const;
     TMatrixD getInvertedMatrix() const;
     double getCondition() const;
-    
+    double getMatrixBuildTime() const;
+    double getInversionTime() const;
+    std::vector<PrecisionReport> comparePrecisions(size_t nrep = 1000) const;
+    const RooLagrangianMorphing::Statistics& getStatistics() const;
+    void resetStatistics();
+    void writeStatistics(std::ostream& stream) const;
+    RooLagrangianMorphing::MemoryReport getMemoryReport() const;
+    void printMemoryReport() const;
+
+    std::vector<double> getFormulaValues() const;
+    std::vector<double> getFormulaGradient(const char* paramname, double epsilon = 1e-6) const;
+    std::vector<double> getWeightValues() const;
+    std::vector<double> getWeightGradient(const char* paramname, double epsilon = 1e-6) const;
+    std::vector<double> getSampleYields() const;
+    std::vector<double> getSampleSumW2() const;
+    std::vector<std::vector<double> > getSampleTemplates(bool errors = false) const;
+    bool allowsNegativeYields() const;
+
     RooRealVar* getObservable() const;
+    const RooArgList& getObservables() const;
     RooRealVar* getBinWidth() const;
  
     void printEvaluation() const;
+    void printPrecisions() const;
     void printCouplings() const;
     void printParameters() const;
     void printParameters(const char* samplename) const;
@@ -164,8 +231,12 @@ namespace RooLagrangianMorphing {
     const std::vector<std::string>& getSamples() const;
   
     double expectedUncertainty() const;
+    std::vector<double> expectedUncertainty(const std::vector<ParamSet>& points);
     TH1* createTH1(const std::string& name, RooFitResult* r = NULL);
     TH1* createTH1(const std::string& name, bool correlateErrors, RooFitResult* r = NULL);
+    TMatrixD createTemplateCovarianceMatrix(const TMatrixD* sampleCorrelation = NULL) const;
+    TMatrixD createParameterCovarianceMatrix(const RooFitResult* r) const;
+    TMatrixD createCovarianceMatrix(const RooFitResult* r = NULL, const TMatrixD* sampleCorrelation = NULL) const;
   
   protected:
 
@@ -193,6 +264,8 @@ namespace RooLagrangianMorphing {
     void collectInputs(TDirectory* f);
     void updateSampleWeights();
     RooRealVar* setupObservable(const char* obsname,TClass* mode,TObject* inputExample);
+    void setSharedCache(const std::shared_ptr<RooLagrangianMorphing::SharedCache>& shared) const;
+    void fillMemoryReport(RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen) const;
     
   public:
   
@@ -200,6 +273,8 @@ namespace RooLagrangianMorphing {
     bool useCoefficients(const TMatrixD& inverse);
     bool useCoefficients(const char* filename);
     bool writeCoefficients(const char* filename);
+    std::shared_ptr<RooLagrangianMorphing::WeightEngine> getWeightEngine();
+    bool setWeightEngine(const std::shared_ptr<RooLagrangianMorphing::WeightEngine>& engine);
   
     int countContributingFormulas() const;
     RooParamHistFunc* getBaseTemplate();
@@ -223,12 +298,18 @@ namespace RooLagrangianMorphing {
     RooListProxy _flags;
     std::vector<RooListProxy*> _vertices;
     std::vector<RooListProxy*> _nonInterfering;
+    mutable std::shared_ptr<RooLagrangianMorphing::WeightEngine> _weightEngine; //!
+    mutable std::shared_ptr<RooLagrangianMorphing::SharedCache> _sharedCache; //!
+    mutable std::string _persistedInverse;
+    mutable double _persistedCondition = 0.;
+    mutable std::vector<std::vector<int> > _persistedPattern;
+    mutable RooLagrangianMorphing::Statistics _statistics; //!
 
     mutable const RooArgSet* _curNormSet ; //! 
 
   public:
 
-    ClassDefT(RooLagrangianMorphBase<Base>,4)
+    ClassDefT(RooLagrangianMorphBase<Base>,5)
   
     ////////////////////////////////////////////////////////////////////////////////////////////////
     //
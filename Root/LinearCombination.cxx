@@ -1,5 +1,22 @@
-#ifdef USE_UBLAS
 #include "RooLagrangianMorphing/LinearCombination.h"
+#include "RooLagrangianMorphing/RooLagrangianMorphing.h"
+
+#include <cmath>
+
+namespace {
+  inline void splitCoefficient(const RooLagrangianMorphing::SuperFloat& c, double& hi, double& lo){
+    // represent a coefficient as the unevaluated sum of two doubles
+#ifdef USE_UBLAS
+    hi = c.convert_to<double>();
+    RooLagrangianMorphing::SuperFloat rest(c);
+    rest -= hi;
+    lo = rest.convert_to<double>();
+#else
+    hi = c;
+    lo = 0.;
+#endif
+  }
+}
 
 namespace RooLagrangianMorphing {
   LinearCombination::LinearCombination() :
@@ -58,29 +75,117 @@ namespace RooLagrangianMorphing {
     // add a new term
     _actualVars.add(*t);
     _coefficients.push_back(c);
+    _coefficientsHi.clear();
+    _coefficientsLo.clear();
   }
 
   void LinearCombination::setCoefficient(size_t idx,SuperFloat c){
     // set the coefficient with the given index
     this->_coefficients[idx]=c;
+    // the split coefficients and the nonzero terms are refreshed lazily
+    this->_coefficientsHi.clear();
+    this->_coefficientsLo.clear();
+  }
+
+  void LinearCombination::splitCoefficients() const {
+    // precompute the double-double representation of all coefficients and
+    // the list of terms with nonzero coefficients, which is all that needs
+    // to be evaluated for block-structured morphing matrices
+    const std::size_t n(this->_coefficients.size());
+    this->_coefficientsHi.resize(n);
+    this->_coefficientsLo.resize(n);
+    this->_nonZero.clear();
+    for(std::size_t i=0;i<n; ++i){
+      splitCoefficient(this->_coefficients[i],this->_coefficientsHi[i],this->_coefficientsLo[i]);
+      if(this->_coefficients[i] != 0) this->_nonZero.push_back(i);
+    }
   }
   
   SuperFloat LinearCombination::getCoefficient(size_t idx){
     // get the coefficient with the given index
       return this->_coefficients[idx];
   }
+
+  std::size_t LinearCombination::getMemorySize() const {
+    // estimate the memory (in bytes) held by this object, including the
+    // coefficients and their split double-double representation
+    return sizeof(LinearCombination)
+      + this->_coefficients.capacity()*sizeof(SuperFloat)
+      + (this->_coefficientsHi.capacity() + this->_coefficientsLo.capacity())*sizeof(double)
+      + this->_nonZero.capacity()*sizeof(std::size_t)
+      + this->_actualVars.getSize()*sizeof(void*);
+  }
   
   Double_t LinearCombination::evaluate() const {
-    // call the evaluation
+    // call the evaluation in the precision selected by gEvaluationPrecision
+    if(this->_coefficientsHi.size() != this->_coefficients.size()) this->splitCoefficients();
+    switch(gEvaluationPrecision){
+    case DoublePrecision: {
+      // leading double of every coefficient only
+      double result = 0.;
+      for(const std::size_t i:this->_nonZero){
+        result += this->_coefficientsHi[i] * (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal();
+      }
+      return result;
+    }
+    case LongDoublePrecision: {
+      long double result = 0.;
+      for(const std::size_t i:this->_nonZero){
+        const long double c = (long double)(this->_coefficientsHi[i]) + this->_coefficientsLo[i];
+        result += c * (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal();
+      }
+      return (double)(result);
+    }
+    case DoubleDoublePrecision: {
+      // double-double coefficients with compensated (Neumaier) summation,
+      // close to the multiprecision result at the speed of plain doubles
+      double sum = 0.;
+      double compensation = 0.;
+      for(const std::size_t i:this->_nonZero){
+        const double val = (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal();
+        const double hi = this->_coefficientsHi[i];
+        const double prod = hi * val;
+        compensation += std::fma(hi,val,-prod) + this->_coefficientsLo[i] * val;
+        const double t = sum + prod;
+        if(std::fabs(sum) >= std::fabs(prod)){
+          compensation += (sum - t) + prod;
+        } else {
+          compensation += (prod - t) + sum;
+        }
+        sum = t;
+      }
+      return sum + compensation;
+    }
+#ifdef __SIZEOF_FLOAT128__
+    case QuadPrecision: {
+      __float128 result = 0.;
+      for(const std::size_t i:this->_nonZero){
+        const __float128 c = (__float128)(this->_coefficientsHi[i]) + this->_coefficientsLo[i];
+        result += c * (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal();
+      }
+      return (double)(result);
+    }
+#endif
+    default:
+      // the precision fixed at compile time
+      break;
+    }
+#ifdef USE_UBLAS
     SuperFloat result;
     result.assign(0.);
-    const std::size_t n(this->_actualVars.getSize());
-    for(std::size_t i=0;i<n; ++i){
+    for(const std::size_t i:this->_nonZero){
       SuperFloat tmp;
       tmp.assign( (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal() );
       result += this->_coefficients[i] * tmp;
     }
     return result.convert_to<double>();
+#else
+    double result = 0.;
+    for(const std::size_t i:this->_nonZero){
+      result += this->_coefficients[i] * (static_cast<const RooAbsReal*>(this->_actualVars.at(i)))->getVal();
+    }
+    return result;
+#endif
   }
   
   std::list<Double_t>* LinearCombination::binBoundaries(RooAbsRealLValue& obs, Double_t xlo, Double_t xhi) const {
@@ -112,6 +217,3 @@ namespace RooLagrangianMorphing {
 }
 
 ClassImp(RooLagrangianMorphing::LinearCombination)
-  
-#endif
-
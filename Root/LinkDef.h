@@ -2,6 +2,8 @@
 #include "RooLagrangianMorphing/LinearCombination.h"
 #include "RooLagrangianMorphing/RooLagrangianMorphing.h"
 #include "RooLagrangianMorphing/RooLagrangianMorphOptimizer.h"
+#include "RooLagrangianMorphing/RooLagrangianMorphGridScanner.h"
+#include "RooLagrangianMorphing/RooLagrangianMorphInputGenerator.h"
 
 #ifdef __CINT__
 
@@ -16,6 +18,8 @@
 #pragma link C++ class RooLagrangianMorphFunc+;
 #pragma link C++ class RooLagrangianMorphPdf+;
 #pragma link C++ class RooLagrangianMorphOptimizer+;
+#pragma link C++ class RooLagrangianMorphGridScanner;
+#pragma link C++ class RooLagrangianMorphInputGenerator;
 #pragma link C++ class RooHCggfWWMorphFunc+;
 #pragma link C++ class RooHCvbfWWMorphFunc+;
 #pragma link C++ class RooHCggfZZMorphFunc+;
@@ -30,9 +34,7 @@
 #pragma link C++ class RooSMEFTvbfWWMorphFunc+;
 #pragma link C++ class RooSMEFTggfWWMorphPdf+;
 #pragma link C++ class RooSMEFTvbfWWMorphPdf+;
-#ifdef USE_UBLAS
 #pragma link C++ class RooLagrangianMorphing::LinearCombination+;
-#endif
 
 #endif // __CINT__
 
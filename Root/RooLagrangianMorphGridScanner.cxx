@@ -0,0 +1,331 @@
+#include <RooLagrangianMorphing/RooLagrangianMorphGridScanner.h>
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TString.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+
+#define ERROR(arg){                                                     \
+  if(RooLagrangianMorphing::gAllowExceptions){                                \
+    std::stringstream err; err << arg << std::endl; throw(std::runtime_error(err.str())); \
+  } else {                                                              \
+    std::cerr << arg << std::endl;                                      \
+  }}
+#define INFO(arg) std::cout << arg << std::endl;
+
+namespace {
+  void morphPoints(size_t nsamples, size_t nbins, const double* templates, const double* errors2, const double* weights, bool allowNegativeYields, double* contents, double* errors, size_t first, size_t last){
+    // assemble the morphed templates for a range of points from the sample weights
+    // as in the morphing function, every component w*T is clamped at zero
+    // unless negative yields are allowed, clamped components carry no error
+    // this only touches plain arrays, and is safe to run concurrently on disjoint ranges
+    for(size_t p=first; p<last; ++p){
+      double* out = contents + p*nbins;
+      double* err = errors ? errors + p*nbins : NULL;
+      std::fill(out,out+nbins,0.);
+      if(err) std::fill(err,err+nbins,0.);
+      const double* w = weights + p*nsamples;
+      for(size_t s=0; s<nsamples; ++s){
+        if(w[s] == 0.) continue;
+        const double* t = templates + s*nbins;
+        const double w2 = w[s]*w[s];
+        const double* e2 = errors2 + s*nbins;
+        for(size_t b=0; b<nbins; ++b){
+          const double v = w[s]*t[b];
+          if(!allowNegativeYields && v < 0.) continue;
+          out[b] += v;
+          if(err) err[b] += w2*e2[b];
+        }
+      }
+      if(err){
+        for(size_t b=0; b<nbins; ++b) err[b] = sqrt(err[b]);
+      }
+    }
+  }
+}
+
+//_____________________________________________________________________________
+
+RooLagrangianMorphGridScanner::RooLagrangianMorphGridScanner(RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsReal>* func){
+  // create a scanner for a morphing function
+  if(!func){
+    ERROR("invalid morphing function given!");
+    return;
+  }
+  this->fSetParameters = [func](const ParamSet& p){ func->setParameters(p); };
+  this->fGetParameters = [func](){ return func->getParameters(); };
+  this->fGetWeights = [func](){ return func->getWeightValues(); };
+  this->fGetTemplates = [func](bool errors){ return func->getSampleTemplates(errors); };
+  this->fAllowNegativeYields = func->allowsNegativeYields();
+}
+
+RooLagrangianMorphGridScanner::RooLagrangianMorphGridScanner(RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsPdf>* func){
+  // create a scanner for a morphing pdf
+  if(!func){
+    ERROR("invalid morphing function given!");
+    return;
+  }
+  this->fSetParameters = [func](const ParamSet& p){ func->setParameters(p); };
+  this->fGetParameters = [func](){ return func->getParameters(); };
+  this->fGetWeights = [func](){ return func->getWeightValues(); };
+  this->fGetTemplates = [func](bool errors){ return func->getSampleTemplates(errors); };
+  this->fAllowNegativeYields = func->allowsNegativeYields();
+}
+
+RooLagrangianMorphGridScanner::~RooLagrangianMorphGridScanner(){
+  // default destructor
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphGridScanner::addAxis(const char* name, int n, double min, double max){
+  // add a parameter to the cartesian grid, sampled at n equidistant points
+  // including both ends of the range. the first axis varies slowest
+  if(this->fPoints.size() > 0){
+    ERROR("cannot combine a cartesian grid with a list of points!");
+    return;
+  }
+  if(n < 1){
+    ERROR("axis " << name << " needs at least one point!");
+    return;
+  }
+  this->fAxes.push_back(Axis(name,n,min,max));
+}
+
+void RooLagrangianMorphGridScanner::setPoints(const std::vector<ParamSet>& points){
+  // scan a list of points instead of a cartesian grid
+  // all points need to set the same parameters
+  if(this->fAxes.size() > 0){
+    ERROR("cannot combine a cartesian grid with a list of points!");
+    return;
+  }
+  for(size_t i=0; i<points.size(); ++i){
+    bool same = (points[i].size() == points.front().size());
+    for(const auto& p:points.front()){
+      if(!same) break;
+      same = (points[i].find(p.first) != points[i].end());
+    }
+    if(!same){
+      ERROR("point " << i << " does not set the same parameters as the first point!");
+      return;
+    }
+  }
+  this->fPoints = points;
+}
+
+void RooLagrangianMorphGridScanner::setNumThreads(int n){
+  // set the number of threads, 0 uses all available cores
+  this->fNumThreads = n;
+}
+
+void RooLagrangianMorphGridScanner::setChunkSize(size_t n){
+  // set the number of points held in memory at any time
+  this->fChunkSize = std::max(size_t(1),n);
+}
+
+void RooLagrangianMorphGridScanner::setStoreErrors(bool store){
+  // choose whether the statistical errors of the morphed templates are stored
+  this->fStoreErrors = store;
+}
+
+//_____________________________________________________________________________
+
+size_t RooLagrangianMorphGridScanner::nPoints() const {
+  // retrieve the number of points to be scanned
+  if(this->fAxes.empty()) return this->fPoints.size();
+  size_t n = 1;
+  for(const auto& a:this->fAxes) n *= a.n;
+  return n;
+}
+
+size_t RooLagrangianMorphGridScanner::nBins() const {
+  // retrieve the number of bins of the morphed templates
+  return this->fNBins;
+}
+
+std::vector<std::string> RooLagrangianMorphGridScanner::parameterNames() const {
+  // retrieve the names of the scanned parameters
+  std::vector<std::string> names;
+  if(this->fAxes.empty()){
+    if(this->fPoints.empty()) return names;
+    for(const auto& p:this->fPoints.front()) names.push_back(p.first);
+  } else {
+    for(const auto& a:this->fAxes) names.push_back(a.name);
+  }
+  return names;
+}
+
+RooLagrangianMorphGridScanner::ParamSet RooLagrangianMorphGridScanner::getPoint(size_t i) const {
+  // retrieve the parameters of the i-th point
+  if(this->fAxes.empty()) return this->fPoints.at(i);
+  ParamSet p;
+  for(size_t a=this->fAxes.size(); a-- > 0;){
+    const Axis& axis = this->fAxes[a];
+    const size_t idx = i % axis.n;
+    i /= axis.n;
+    p[axis.name] = (axis.n > 1 ? axis.min + idx*(axis.max-axis.min)/(axis.n-1) : axis.min);
+  }
+  return p;
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphGridScanner::setup(){
+  // copy the sample templates into flat arrays, padding them to a common number of bins
+  const std::vector<std::vector<double> > templates(this->fGetTemplates(false));
+  const std::vector<std::vector<double> > errors(this->fGetTemplates(true));
+  this->fNSamples = templates.size();
+  this->fNBins = 0;
+  for(const auto& t:templates) this->fNBins = std::max(this->fNBins,t.size());
+  this->fTemplates.assign(this->fNSamples*this->fNBins,0.);
+  this->fErrors2.assign(this->fNSamples*this->fNBins,0.);
+  for(size_t s=0; s<this->fNSamples; ++s){
+    std::copy(templates[s].begin(),templates[s].end(),this->fTemplates.begin()+s*this->fNBins);
+    for(size_t b=0; b<errors[s].size(); ++b){
+      this->fErrors2[s*this->fNBins+b] = errors[s][b]*errors[s][b];
+    }
+  }
+}
+
+void RooLagrangianMorphGridScanner::scan(const Sink& sink){
+  // evaluate all points chunk by chunk and pass the results to the sink
+  // the weights are evaluated by the morphing function in the calling
+  // thread, as RooFit is not thread safe, while the templates are
+  // assembled in parallel. the parameters are restored afterwards
+  // the sample templates need to be prepared with setup() beforehand
+  const ParamSet values(this->fGetParameters());
+  const std::vector<std::string> names(this->parameterNames());
+  const size_t npars = names.size();
+  const size_t npoints = this->nPoints();
+  const size_t chunk = std::min(this->fChunkSize,std::max(npoints,size_t(1)));
+  size_t nthreads = this->fNumThreads > 0 ? this->fNumThreads : std::max(1u,std::thread::hardware_concurrency());
+  nthreads = std::max(size_t(1),std::min(nthreads,chunk));
+
+  std::vector<double> params(chunk*npars);
+  std::vector<double> weights(chunk*this->fNSamples);
+  std::vector<double> contents(chunk*this->fNBins);
+  std::vector<double> errors(this->fStoreErrors ? chunk*this->fNBins : 0);
+
+  for(size_t start=0; start<npoints; start+=chunk){
+    const size_t n = std::min(chunk,npoints-start);
+    for(size_t i=0; i<n; ++i){
+      const ParamSet point(this->getPoint(start+i));
+      this->fSetParameters(point);
+      for(size_t j=0; j<npars; ++j){
+        params[i*npars+j] = point.at(names[j]);
+      }
+      const std::vector<double> w(this->fGetWeights());
+      if(w.size() != this->fNSamples){
+        this->fSetParameters(values);
+        ERROR("number of weights (" << w.size() << ") does not match the number of samples (" << this->fNSamples << ")!");
+        return;
+      }
+      std::copy(w.begin(),w.end(),weights.begin()+i*this->fNSamples);
+    }
+    const size_t per = (n + nthreads - 1) / nthreads;
+    std::vector<std::thread> workers;
+    for(size_t t=0; t<nthreads; ++t){
+      const size_t first = t*per;
+      const size_t last = std::min(first+per,n);
+      if(first >= last) break;
+      workers.push_back(std::thread(morphPoints,this->fNSamples,this->fNBins,this->fTemplates.data(),this->fErrors2.data(),weights.data(),this->fAllowNegativeYields,contents.data(),this->fStoreErrors ? errors.data() : (double*)NULL,first,last));
+    }
+    for(auto& w:workers){
+      w.join();
+    }
+    sink(n,params.data(),contents.data(),this->fStoreErrors ? errors.data() : NULL);
+  }
+  this->fSetParameters(values);
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphGridScanner::writeBinary(const char* filename){
+  // write the scan to a compact binary file (native byte order)
+  //   char[8]  "RLMGRID1"
+  //   uint32   number of parameters
+  //   uint32   number of bins
+  //   uint32   flags (1: errors are stored)
+  //   uint64   number of points
+  //   per parameter: uint32 length, followed by the name
+  //   per point: double parameters[nparams], double contents[nbins], (double errors[nbins])
+  std::ofstream out(filename,std::ios::binary);
+  if(!out.good()){
+    ERROR("unable to open file '" << filename << "'!");
+    return;
+  }
+  this->setup();
+  const std::vector<std::string> names(this->parameterNames());
+  const uint32_t npars = names.size();
+  const uint32_t nbins = this->fNBins;
+  const uint32_t flags = this->fStoreErrors ? 1 : 0;
+  const uint64_t npoints = this->nPoints();
+  out.write("RLMGRID1",8);
+  out.write((const char*)&npars,sizeof(npars));
+  out.write((const char*)&nbins,sizeof(nbins));
+  out.write((const char*)&flags,sizeof(flags));
+  out.write((const char*)&npoints,sizeof(npoints));
+  for(const auto& name:names){
+    const uint32_t len = name.size();
+    out.write((const char*)&len,sizeof(len));
+    out.write(name.data(),len);
+  }
+  this->scan([&](size_t n, const double* params, const double* contents, const double* errors){
+      for(size_t i=0; i<n; ++i){
+        out.write((const char*)(params+i*npars),npars*sizeof(double));
+        out.write((const char*)(contents+i*nbins),nbins*sizeof(double));
+        if(errors) out.write((const char*)(errors+i*nbins),nbins*sizeof(double));
+      }
+    });
+  if(!out.good()){
+    ERROR("error while writing file '" << filename << "'!");
+  }
+}
+
+void RooLagrangianMorphGridScanner::writeTree(const char* filename, const char* treename){
+  // write the scan to a TTree, with one branch per parameter and array
+  // branches for the contents and errors of the morphed templates
+  // the tree is flushed to the file as it fills
+  TFile* file = TFile::Open(filename,"RECREATE");
+  if(!file || file->IsZombie()){
+    ERROR("unable to open file '" << filename << "'!");
+    delete file;
+    return;
+  }
+  this->setup();
+  const std::vector<std::string> names(this->parameterNames());
+  const size_t npars = names.size();
+  const size_t nbins = this->fNBins;
+  std::vector<double> parbuf(npars);
+  std::vector<double> contentbuf(nbins);
+  std::vector<double> errorbuf(nbins);
+  TTree* tree = new TTree(treename,treename);
+  tree->SetDirectory(file);
+  for(size_t j=0; j<npars; ++j){
+    tree->Branch(names[j].c_str(),&parbuf[j],TString::Format("%s/D",names[j].c_str()));
+  }
+  tree->Branch("contents",contentbuf.data(),TString::Format("contents[%d]/D",int(nbins)));
+  if(this->fStoreErrors){
+    tree->Branch("errors",errorbuf.data(),TString::Format("errors[%d]/D",int(nbins)));
+  }
+  this->scan([&](size_t n, const double* params, const double* contents, const double* errors){
+      for(size_t i=0; i<n; ++i){
+        std::copy(params+i*npars,params+(i+1)*npars,parbuf.begin());
+        std::copy(contents+i*nbins,contents+(i+1)*nbins,contentbuf.begin());
+        if(errors) std::copy(errors+i*nbins,errors+(i+1)*nbins,errorbuf.begin());
+        tree->Fill();
+      }
+    });
+  file->cd();
+  tree->Write();
+  file->Close();
+  delete file;
+}
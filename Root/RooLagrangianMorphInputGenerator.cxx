@@ -0,0 +1,294 @@
+#include <RooLagrangianMorphing/RooLagrangianMorphInputGenerator.h>
+
+#include <RooRealVar.h>
+#include <RooArgSet.h>
+
+#include <TDirectory.h>
+#include <TFile.h>
+#include <TFolder.h>
+#include <TH1F.h>
+#include <TMap.h>
+#include <TParameter.h>
+#include <TString.h>
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#define ERROR(arg){                                                     \
+  if(RooLagrangianMorphing::gAllowExceptions){                                \
+    std::stringstream err; err << arg << std::endl; throw(std::runtime_error(err.str())); \
+  } else {                                                              \
+    std::cerr << arg << std::endl;                                      \
+  }}
+#define INFO(arg) std::cout << arg << std::endl;
+
+namespace {
+  void setValue(RooRealVar* p, double val){
+    // set the value of a parameter, extending its range if needed
+    if(val > p->getMax()) p->setMax(val);
+    if(val < p->getMin()) p->setMin(val);
+    p->setVal(val);
+  }
+
+  TH1F* makeLabelHist(const char* name, const std::map<const std::string,double>& values){
+    // create a histogram with one labelled bin per value, as used for the param_card
+    TH1F* hist = new TH1F(name,name,values.size(),0,values.size());
+    hist->SetDirectory(0);
+    int bin = 1;
+    for(const auto& v:values){
+      hist->GetXaxis()->SetBinLabel(bin,v.first.c_str());
+      hist->SetBinContent(bin,v.second);
+      ++bin;
+    }
+    return hist;
+  }
+}
+
+//_____________________________________________________________________________
+
+RooLagrangianMorphInputGenerator::RooLagrangianMorphInputGenerator(const std::vector<RooArgList*>& vertices, int nbins, unsigned long long seed){
+  // create a generator for an arbitrary set of vertices
+  // nbins=0 creates cross sections instead of histograms
+  for(const auto& v:vertices){
+    if(!v) ERROR("invalid vertex given!");
+    this->fVertices.push_back(*v);
+  }
+  this->setup(nbins,seed);
+}
+
+RooLagrangianMorphInputGenerator::RooLagrangianMorphInputGenerator(const RooAbsCollection& prodCouplings, const RooAbsCollection& decCouplings, int nbins, unsigned long long seed){
+  // create a generator for a process with one production and one decay vertex
+  this->fVertices.push_back(RooArgList(prodCouplings));
+  this->fVertices.push_back(RooArgList(decCouplings));
+  this->setup(nbins,seed);
+}
+
+RooLagrangianMorphInputGenerator::~RooLagrangianMorphInputGenerator(){
+  // default destructor
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphInputGenerator::setup(int nbins, unsigned long long seed){
+  // collect couplings and operators, and draw the ground-truth amplitudes
+  // the truth is the product over all vertices of |sum_c g_c * a_c(bin)|^2,
+  // which is a polynomial that the morphing reproduces exactly
+  if(nbins < 0) ERROR("number of bins needs to be non-negative!");
+  this->fNBins = nbins;
+  this->fEngine.seed(seed);
+  for(const auto& vertex:this->fVertices){
+    RooFIter itr(vertex.fwdIterator());
+    RooAbsArg* obj;
+    while((obj = itr.next())){
+      RooAbsReal* coupling = dynamic_cast<RooAbsReal*>(obj);
+      if(!coupling) ERROR("coupling " << obj->GetName() << " is not a real-valued object!");
+      if(!this->fCouplings.find(coupling->GetName())) this->fCouplings.add(*coupling);
+      RooArgSet* vars = coupling->getVariables();
+      RooFIter vitr(vars->fwdIterator());
+      RooAbsArg* var;
+      while((var = vitr.next())){
+        if(dynamic_cast<RooRealVar*>(var) && !this->fOperators.find(var->GetName())) this->fOperators.add(*var);
+      }
+      delete vars;
+    }
+  }
+  const size_t n = std::max(this->fNBins,size_t(1));
+  std::uniform_real_distribution<double> amplitude(0.5,1.5);
+  for(const auto& vertex:this->fVertices){
+    std::vector<double> a(vertex.getSize()*n);
+    for(auto& x:a) x = amplitude(this->fEngine);
+    this->fAmplitudes.push_back(a);
+  }
+  // falling spectrum, normalized to unity
+  double sum = 0.;
+  for(size_t b=0; b<n; ++b){
+    this->fShape.push_back(exp(-3.*(b+0.5)/n));
+    sum += this->fShape.back();
+  }
+  for(auto& s:this->fShape) s /= sum;
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphInputGenerator::setRange(double min, double max){
+  // set the default range in which the operators are generated
+  this->fMin = min;
+  this->fMax = max;
+}
+
+void RooLagrangianMorphInputGenerator::setRange(const char* name, double min, double max){
+  // set the range in which one operator is generated
+  if(!this->fOperators.find(name)) ERROR("unknown operator " << name << "!");
+  this->fRanges[name] = std::make_pair(min,max);
+  this->fFixed.erase(name);
+}
+
+void RooLagrangianMorphInputGenerator::fixParameter(const char* name, double value){
+  // keep one operator (e.g. a scale or mixing angle) at a fixed value in all samples
+  if(!this->fOperators.find(name)) ERROR("unknown operator " << name << "!");
+  this->fFixed[name] = value;
+  this->fRanges.erase(name);
+}
+
+void RooLagrangianMorphInputGenerator::setNormalization(double norm){
+  // set the integral of the truth at unit amplitudes
+  this->fNormalization = norm;
+}
+
+//_____________________________________________________________________________
+
+size_t RooLagrangianMorphInputGenerator::nSamples(){
+  // retrieve the minimal number of samples needed to morph this process
+  std::vector<RooArgList*> vertices;
+  for(auto& v:this->fVertices) vertices.push_back(&v);
+  return RooLagrangianMorphing::countSamples(vertices);
+}
+
+size_t RooLagrangianMorphInputGenerator::nBins() const {
+  // retrieve the number of bins of the generated histograms
+  return this->fNBins;
+}
+
+const RooArgList& RooLagrangianMorphInputGenerator::getOperators() const {
+  // retrieve the list of operators appearing in the couplings
+  return this->fOperators;
+}
+
+//_____________________________________________________________________________
+
+RooLagrangianMorphInputGenerator::ParamMap RooLagrangianMorphInputGenerator::generateParamCards(size_t n, const char* prefix){
+  // draw random param_cards for n samples, n=0 generates the minimal number of samples
+  if(n == 0) n = this->nSamples();
+  ParamMap cards;
+  for(size_t i=0; i<n; ++i){
+    ParamSet card;
+    RooFIter itr(this->fOperators.fwdIterator());
+    RooAbsArg* obj;
+    while((obj = itr.next())){
+      const std::string name(obj->GetName());
+      auto fixed = this->fFixed.find(name);
+      if(fixed != this->fFixed.end()){
+        card[name] = fixed->second;
+        continue;
+      }
+      auto range = this->fRanges.find(name);
+      const double min = (range == this->fRanges.end() ? this->fMin : range->second.first);
+      const double max = (range == this->fRanges.end() ? this->fMax : range->second.second);
+      card[name] = std::uniform_real_distribution<double>(min,max)(this->fEngine);
+    }
+    cards[TString::Format("%s%03d",prefix,int(i)).Data()] = card;
+  }
+  return cards;
+}
+
+//_____________________________________________________________________________
+
+void RooLagrangianMorphInputGenerator::setOperators(const ParamSet& params) const {
+  // set the operators to the given values, fixed parameters take precedence over missing ones
+  RooFIter itr(this->fOperators.fwdIterator());
+  RooAbsArg* obj;
+  while((obj = itr.next())){
+    RooRealVar* p = static_cast<RooRealVar*>(obj);
+    auto it = params.find(p->GetName());
+    if(it != params.end()){
+      setValue(p,it->second);
+      continue;
+    }
+    auto fixed = this->fFixed.find(p->GetName());
+    if(fixed != this->fFixed.end()) setValue(p,fixed->second);
+  }
+}
+
+std::vector<double> RooLagrangianMorphInputGenerator::truth(const ParamSet& params) const {
+  // evaluate the ground-truth polynomial at a given point, one value per bin
+  ParamSet current;
+  RooFIter itr(this->fOperators.fwdIterator());
+  RooAbsArg* obj;
+  while((obj = itr.next())){
+    current[obj->GetName()] = static_cast<RooRealVar*>(obj)->getVal();
+  }
+  this->setOperators(params);
+  const size_t n = std::max(this->fNBins,size_t(1));
+  std::vector<double> values(n,this->fNormalization);
+  for(size_t b=0; b<n; ++b) values[b] *= this->fShape[b];
+  for(size_t v=0; v<this->fVertices.size(); ++v){
+    std::vector<double> amp(n,0.);
+    const std::vector<double>& a = this->fAmplitudes[v];
+    RooFIter citr(this->fVertices[v].fwdIterator());
+    size_t c = 0;
+    while((obj = citr.next())){
+      const double g = static_cast<RooAbsReal*>(obj)->getVal();
+      for(size_t b=0; b<n; ++b) amp[b] += g*a[c*n+b];
+      ++c;
+    }
+    for(size_t b=0; b<n; ++b) values[b] *= amp[b]*amp[b];
+  }
+  this->setOperators(current);
+  return values;
+}
+
+TH1* RooLagrangianMorphInputGenerator::createTruthTH1(const ParamSet& params, const char* name) const {
+  // create a histogram of the ground truth at a given point, with poissonian errors
+  const std::vector<double> values(this->truth(params));
+  TH1F* hist = new TH1F(name,name,values.size(),0.,1.);
+  hist->SetDirectory(0);
+  for(size_t b=0; b<values.size(); ++b){
+    hist->SetBinContent(b+1,values[b]);
+    hist->SetBinError(b+1,sqrt(fabs(values[b])));
+  }
+  return hist;
+}
+
+//_____________________________________________________________________________
+
+TFolder* RooLagrangianMorphInputGenerator::makeSampleFolder(const std::string& name, const ParamSet& params, const char* obsName, const FlagSet* flags) const {
+  // create the input folder of one sample in the layout expected by the morphing
+  // with nbins=0 the observable is stored as a cross section with its uncertainty
+  TFolder* folder = new TFolder(name.c_str(),name.c_str());
+  folder->SetOwner(true);
+  ParamSet card(params);
+  for(const auto& p:this->fFixed){
+    if(card.find(p.first) == card.end()) card[p.first] = p.second;
+  }
+  folder->Add(makeLabelHist("param_card",card));
+  if(flags){
+    ParamSet values;
+    for(const auto& f:*flags) values[f.first] = f.second;
+    folder->Add(makeLabelHist("flags",values));
+  }
+  if(this->fNBins > 0){
+    folder->Add(this->createTruthTH1(params,obsName));
+  } else {
+    const double xs = this->truth(params)[0];
+    folder->Add(new TPair(new TParameter<double>(obsName,xs),new TParameter<double>("uncertainty",sqrt(fabs(xs)))));
+  }
+  return folder;
+}
+
+void RooLagrangianMorphInputGenerator::write(TDirectory* dir, const ParamMap& samples, const char* obsName, const FlagMap& flags) const {
+  // write the samples to a directory, one folder per sample
+  if(!dir) ERROR("invalid directory given!");
+  for(const auto& sample:samples){
+    auto f = flags.find(sample.first);
+    TFolder* folder = this->makeSampleFolder(sample.first,sample.second,obsName,f == flags.end() ? NULL : &(f->second));
+    dir->WriteTObject(folder);
+    delete folder;
+  }
+}
+
+void RooLagrangianMorphInputGenerator::write(const char* filename, const ParamMap& samples, const char* obsName, const FlagMap& flags) const {
+  // write the samples to a new file, one folder per sample
+  TFile* file = TFile::Open(filename,"RECREATE");
+  if(!file || file->IsZombie()){
+    delete file;
+    ERROR("unable to open file '" << filename << "' for writing!");
+    return;
+  }
+  this->write(file,samples,obsName,flags);
+  file->Close();
+  delete file;
+  INFO("wrote " << samples.size() << " samples to '" << filename << "'");
+}
@@ -7,6 +7,7 @@
 #include <TLine.h>
 #include <TFolder.h>
 #include <TH1F.h>
+#include <TH2D.h>
 #include <TDirectory.h>
 
 #include <Math/ProbFuncMathCore.h>
@@ -15,10 +16,14 @@
 #include "TGraph.h"
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <chrono>
+#include <cstdio>
 #include <algorithm>
 #include <cmath>
 #include <cfloat>
+#include <thread>
 
 #include <RooStringVar.h>
 #include <RooFormulaVar.h>
@@ -36,13 +41,160 @@
 
 RooLagrangianMorphOptimizer* RooLagrangianMorphOptimizer::gActiveInstance = NULL;
 
+namespace {
+  inline double wallTime(){
+    // monotonic wall time in seconds
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+}
+
+namespace {
+  inline std::mt19937_64 makeEngine(unsigned long long seed, unsigned long long stream){
+    // create an engine for a given seed and stream, different streams are statistically independent
+    std::seed_seq seq{(unsigned int)(seed & 0xffffffff),(unsigned int)(seed >> 32),(unsigned int)(stream & 0xffffffff),(unsigned int)(stream >> 32)};
+    return std::mt19937_64(seq);
+  }
+  inline double uniform(std::mt19937_64& engine){
+    // draw a number uniformly from [0,1) with full double resolution, independent of the platform
+    return (engine() >> 11) * (1./9007199254740992.);
+  }
+
+  // primitive polynomials and initial direction numbers of the Sobol sequence
+  // for dimensions 2-21, taken from S. Joe and F. Y. Kuo (new-joe-kuo-6.21201)
+  const unsigned int gSobolDegree[] = { 1, 2, 3, 3, 4, 4, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 7, 7 };
+  const unsigned int gSobolCoeff[]  = { 0, 1, 1, 2, 1, 4, 2, 4, 7,11,13,14, 1,13,16,19,22,25, 1, 4 };
+  const unsigned int gSobolInit[][7] = {
+    {1},{1,3},{1,3,1},{1,1,1},{1,1,3,3},{1,3,5,13},{1,1,5,5,17},{1,1,5,5,5},{1,1,7,11,19},{1,1,5,1,1},
+    {1,1,1,3,11},{1,3,5,5,31},{1,3,3,9,7,49},{1,1,1,15,21,21},{1,3,1,13,27,49},{1,1,1,15,7,5},
+    {1,3,1,15,13,25},{1,1,5,5,19,61},{1,3,7,11,23,15,103},{1,3,7,13,13,15,69}
+  };
+  const size_t gSobolMaxDim = sizeof(gSobolDegree)/sizeof(gSobolDegree[0]) + 1;
+
+  void sobolDirections(size_t dim, unsigned int* v){
+    // compute the 32 direction numbers of a dimension of the Sobol sequence
+    if(dim == 0){
+      for(size_t i=0; i<32; ++i) v[i] = 1u << (31-i);
+      return;
+    }
+    const unsigned int s = gSobolDegree[dim-1];
+    const unsigned int a = gSobolCoeff[dim-1];
+    for(size_t i=0; i<32; ++i){
+      if(i < s){
+        v[i] = gSobolInit[dim-1][i] << (31-i);
+      } else {
+        v[i] = v[i-s] ^ (v[i-s] >> s);
+        for(size_t k=1; k<s; ++k){
+          if((a >> (s-1-k)) & 1) v[i] ^= v[i-k];
+        }
+      }
+    }
+  }
+}
+
+RooLagrangianMorphOptimizer::RandomLagrangianGenerator::RandomLagrangianGenerator(unsigned long long seed, unsigned long long stream, Mode mode) :
+  fEngine(makeEngine(seed,stream)), fSeed(seed), fStream(stream), fMode(mode)
+{
+  // create a generator with its own engine
+  // generators with the same seed but different streams can be used by independent workers
+}
+void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::setSeed(unsigned long long seed, unsigned long long stream){
+  // reseed the generator and its couplings, and restart the sequence
+  this->fEngine = makeEngine(seed,stream);
+  this->fSeed = seed;
+  this->fStream = stream;
+  this->fIndex = 0;
+  this->seedCouplings();
+}
+void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::seedCouplings(){
+  // give every coupling its own stream, derived from the stream of the
+  // generator and the index of the coupling. the index is kept in the upper
+  // half of the stream, such that it does not collide with the streams of
+  // other generators as long as those fit into 32 bits
+  unsigned long long index = 0;
+  for(const auto& c:this->fCouplings){
+    ++index;
+    c.second.fEngine = makeEngine(this->fSeed,this->fStream + (index << 32));
+  }
+}
+void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::setMode(Mode mode){
+  // select how the coupling space is covered
+  //   Uniform:        independent uniform random numbers
+  //   Sobol:          digitally shifted Sobol sequence, where the shift is drawn from the engine
+  //   LatinHypercube: stratified in every coupling, only for batches generated with generate(n)
+  this->fMode = mode;
+  this->fIndex = 0;
+}
+std::vector<double> RooLagrangianMorphOptimizer::RandomLagrangianGenerator::nextUnitPoint(){
+  // obtain the next point in the unit hypercube
+  const size_t ndim = this->fCouplings.size();
+  std::vector<double> u(ndim);
+  if(this->fMode == Sobol){
+    if(ndim > gSobolMaxDim){
+      ERROR("Sobol sampling supports at most " << gSobolMaxDim << " couplings, got " << ndim);
+    }
+    if(this->fIndex == 0){
+      this->fSobolState.assign(ndim,0);
+      this->fSobolShift.resize(ndim);
+      for(size_t d=0; d<ndim; ++d) this->fSobolShift[d] = (unsigned int)(this->fEngine() >> 32);
+      // the direction numbers only depend on the dimension, compute them once per sequence
+      this->fSobolDirections.resize(ndim*32);
+      for(size_t d=0; d<ndim; ++d) sobolDirections(d,&(this->fSobolDirections[d*32]));
+    } else {
+      // Gray code update, using the rightmost zero bit of the previous index
+      size_t c = 0;
+      for(unsigned long long i = this->fIndex-1; i & 1; i >>= 1) ++c;
+      if(c >= 32){
+        ERROR("Sobol sequence exhausted!");
+      }
+      for(size_t d=0; d<ndim; ++d){
+        this->fSobolState[d] ^= this->fSobolDirections[d*32+c];
+      }
+    }
+    for(size_t d=0; d<ndim; ++d){
+      u[d] = (this->fSobolState[d] ^ this->fSobolShift[d]) * (1./4294967296.);
+    }
+  } else {
+    for(size_t d=0; d<ndim; ++d){
+      u[d] = uniform(this->fEngine);
+    }
+  }
+  ++this->fIndex;
+  return u;
+}
 RooLagrangianMorphOptimizer::ParamCard RooLagrangianMorphOptimizer::RandomLagrangianGenerator::generate(){
+  // generate a single point, a latin hypercube of a single point is uniform
+  const std::vector<double> u(this->nextUnitPoint());
   RooLagrangianMorphOptimizer::ParamCard pc;
+  size_t d = 0;
   for(const auto& c:this->fCouplings){
-    pc.insert(std::make_pair(c.first,c.second.generate()));
+    pc.insert(std::make_pair(c.first,c.second.transform(u[d])));
+    ++d;
   }
   return pc;
 }
+std::vector<RooLagrangianMorphOptimizer::ParamCard> RooLagrangianMorphOptimizer::RandomLagrangianGenerator::generate(size_t n){
+  // generate a batch of n points
+  std::vector<RooLagrangianMorphOptimizer::ParamCard> pcs;
+  if(this->fMode != LatinHypercube){
+    for(size_t i=0; i<n; ++i){
+      pcs.push_back(this->generate());
+    }
+    return pcs;
+  }
+  // every coupling is divided into n strata, each of which is hit exactly once
+  pcs.resize(n);
+  std::vector<size_t> perm(n);
+  for(const auto& c:this->fCouplings){
+    for(size_t i=0; i<n; ++i) perm[i] = i;
+    for(size_t i=n; i>1; --i){
+      std::swap(perm[i-1],perm[this->fEngine() % i]);
+    }
+    for(size_t i=0; i<n; ++i){
+      pcs[i].insert(std::make_pair(c.first,c.second.transform((perm[i] + uniform(this->fEngine))/n)));
+    }
+  }
+  return pcs;
+}
 void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::print(){
   for(const auto&gen:this->fCouplings){
     std::cout << gen.first << " " << gen.second.fLower << " -- " << gen.second.fUpper << std::endl;
@@ -50,10 +202,16 @@ void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::print(){
 }
 void RooLagrangianMorphOptimizer::RandomLagrangianGenerator::addCoupling(const std::string& name, double min, double max){
   this->fCouplings.insert(std::make_pair(name,RandomCouplingGenerator(min,max)));
+  this->fIndex = 0;
+  this->seedCouplings();
 }
-RooLagrangianMorphOptimizer::RandomCouplingGenerator::RandomCouplingGenerator(double low, double high) : fLower(low),fUpper(high) {}
+RooLagrangianMorphOptimizer::RandomCouplingGenerator::RandomCouplingGenerator(double low, double high, unsigned long long seed, unsigned long long stream) : fLower(low),fUpper(high),fEngine(makeEngine(seed,stream)) {}
 double RooLagrangianMorphOptimizer::RandomCouplingGenerator::generate() const {
-  return this->fLower + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(this->fUpper-this->fLower)));
+  return this->transform(uniform(this->fEngine));
+}
+double RooLagrangianMorphOptimizer::RandomCouplingGenerator::transform(double u) const {
+  // map a number from [0,1) onto the range of the coupling
+  return this->fLower + u * (this->fUpper-this->fLower);
 }
 
 void RooLagrangianMorphOptimizer::setCrossSection(TFolder* f, const double xs, const double xsunc){
@@ -86,6 +244,8 @@ void RooLagrangianMorphOptimizer::setupMorphFunc(){
 void RooLagrangianMorphOptimizer::setupMorphing(const std::vector<double>& par){
   // setup the temporary morphing function
   int iSample = 0;
+  this->sampleXS.assign(this->temporaries.size(),0.);
+  this->sampleXSUnc.assign(this->temporaries.size(),0.);
   for(const auto& name:this->temporaries){
     TFolder* f = dynamic_cast<TFolder*>(gDirectory->Get(name.Data()));
     if(!f) continue;
@@ -107,6 +267,8 @@ void RooLagrangianMorphOptimizer::setupMorphing(const std::vector<double>& par){
     const double xsunc = (this->presetUncertainty > 0 ? this->presetUncertainty * xs : this->xsHelper->expectedUncertainty());
 
     this->setCrossSection(f,xs,xsunc);
+    this->sampleXS[iSample] = xs;
+    this->sampleXSUnc[iSample] = xsunc;
     ++iSample;
   }
   this->setupMorphFunc();
@@ -117,6 +279,54 @@ void RooLagrangianMorphOptimizer::setEvaluator(Evaluator* eval, double preset){
   this->presetUncertainty = preset;
 }
 
+void RooLagrangianMorphOptimizer::setUseGradient(bool use){
+  // choose whether minuit should be driven by the analytic gradient
+  this->useGradient = use;
+}
+
+void RooLagrangianMorphOptimizer::setConditionPenalty(double weight, double threshold){
+  // add the condition of the morphing matrix to the target function
+  // weight:    the target function is increased by weight*log10(condition)
+  // threshold: candidates with a condition above this value are rejected
+  //            before the (expensive) evaluation of the morphing, 0 disables this
+  this->conditionWeight = weight;
+  this->conditionThreshold = threshold;
+}
+
+double RooLagrangianMorphOptimizer::prescreen(const std::vector<double>& par){
+  // estimate the condition of the morphing matrix for a set of sample parameters
+  // this only evaluates the polynomials of the morphing function, neither the
+  // cross sections of the samples nor the inversion of the matrix are required
+  std::vector<double> matrix;
+  size_t iSample = 0;
+  for(const auto& name:this->temporaries){
+    TFolder* f = dynamic_cast<TFolder*>(gDirectory->Get(name.Data()));
+    if(!f) continue;
+    TH1* param_card = (TH1*)(f->FindObject("param_card"));
+    this->morphFunc->setParameters(param_card);
+    for(size_t i=0; i<this->fnfreeParameters; ++i){
+      this->morphFunc->getParameter(this->parameternames[iSample][i].c_str())->setVal(par[iSample*this->fnfreeParameters+i]);
+    }
+    const std::vector<double> row(this->morphFunc->getFormulaValues());
+    matrix.insert(matrix.end(),row.begin(),row.end());
+    ++iSample;
+  }
+  return RooLagrangianMorphing::estimateCondition(matrix,iSample);
+}
+
+void RooLagrangianMorphOptimizer::Evaluator::gradient(double val_morphed, double unc_morphed, double val_benchmark, double unc_benchmark, double& dval, double& dunc){
+  // derivatives of the evaluator with respect to the morphed value and uncertainty
+  // the default implementation differentiates numerically, which only involves the evaluator itself
+  const double hval = 1e-6*std::max(1.,fabs(val_morphed));
+  const double hunc = 1e-6*std::max(1.,fabs(unc_morphed));
+  dval = ((*this)(val_morphed+hval,unc_morphed,val_benchmark,unc_benchmark) - (*this)(val_morphed-hval,unc_morphed,val_benchmark,unc_benchmark))/(2*hval);
+  if(unc_morphed > hunc){
+    dunc = ((*this)(val_morphed,unc_morphed+hunc,val_benchmark,unc_benchmark) - (*this)(val_morphed,unc_morphed-hunc,val_benchmark,unc_benchmark))/(2*hunc);
+  } else {
+    dunc = ((*this)(val_morphed,unc_morphed+hunc,val_benchmark,unc_benchmark) - (*this)(val_morphed,unc_morphed,val_benchmark,unc_benchmark))/hunc;
+  }
+}
+
 double RooLagrangianMorphOptimizer::testMorphing(){
   // evaluate the temporary morphing function
   double score = 0.;
@@ -137,13 +347,16 @@ double RooLagrangianMorphOptimizer::testMorphing(){
 }
 
 void RooLagrangianMorphOptimizer::printResult(const std::vector<Double_t>&par,Double_t&score){
-  std::cout<<std::endl<<"it: "<<this->iterations<<" score "<<std::setprecision(100)<<score<<std::endl;
+  // max_digits10 is sufficient to reproduce every value exactly
+  const std::streamsize precision = std::cout.precision(std::numeric_limits<double>::max_digits10);
+  std::cout<<std::endl<<"it: "<<this->iterations<<" score "<<score<<std::endl;
   for(size_t i=0; i<this->fnSamples;++i){
     for(size_t j=0; j<this->fnfreeParameters;++j){
-      std::cout<<std::setprecision(100)<<par[i*this->fnfreeParameters+j]<<" ";
+      std::cout<<par[i*this->fnfreeParameters+j]<<" ";
     }
     std::cout<<std::endl;
   }
+  std::cout.precision(precision);
 }
 
 std::vector<double> RooLagrangianMorphOptimizer::getParameterBounds(const std::vector<double>& pars){
@@ -160,35 +373,380 @@ std::vector<double> RooLagrangianMorphOptimizer::getParameterBounds(const std::v
   return pars_limit;
 }
 
-void RooLagrangianMorphOptimizer::targetFcn(Int_t&npar, Double_t* /*gin*/, Double_t&f, Double_t*par, Int_t /*flag*/){
+void RooLagrangianMorphOptimizer::targetFcn(Int_t&npar, Double_t* gin, Double_t&f, Double_t*par, Int_t flag){
   // putting it all together
   std::vector<double> pars(par, par + npar);
+  const bool needGradient = (flag == 2 && gin);
+  RooLagrangianMorphOptimizer* instance = RooLagrangianMorphOptimizer::gActiveInstance;
+  const double fcnStart = wallTime();
+  double setupTime = 0.;
+  double buildTime = 0.;
+  double inversionTime = 0.;
   try {
-    std::vector<double> pars_limit = RooLagrangianMorphOptimizer::gActiveInstance->getParameterBounds(pars);
-    RooLagrangianMorphOptimizer::gActiveInstance->setupMorphing(pars_limit);
-    f = RooLagrangianMorphOptimizer::gActiveInstance->testMorphing();
-    double penalty = 0.;
-    for(size_t ipar=0; ipar<pars.size();ipar++){
-      penalty += std::pow(pars_limit[ipar] - pars[ipar],2);
-    }
-    f *= (1+penalty/npar);
-    if(std::isinf(f) || std::isnan(f)){
-      std::cout << "error: obtained non-numeric result" << std::endl;
+    std::vector<double> pars_limit = instance->getParameterBounds(pars);
+    const bool useCondition = (instance->conditionWeight > 0 || instance->conditionThreshold > 0);
+    double condition = std::numeric_limits<double>::quiet_NaN();
+    if(useCondition && instance->morphFunc){
+      // reject hopeless candidates before the expensive evaluation
+      condition = instance->prescreen(pars_limit);
+    }
+    if(std::isinf(condition) || (instance->conditionThreshold > 0 && condition > instance->conditionThreshold)){
       f = std::numeric_limits<double>::max();
+      if(needGradient) std::fill(gin,gin+npar,0.);
+    } else {
+      const double setupStart = wallTime();
+      instance->setupMorphing(pars_limit);
+      setupTime = wallTime() - setupStart;
+      buildTime = instance->morphFunc->getMatrixBuildTime();
+      inversionTime = instance->morphFunc->getInversionTime();
+      const double score = instance->testMorphing();
+      f = score;
+      double penalty = 0.;
+      for(size_t ipar=0; ipar<pars.size();ipar++){
+        penalty += std::pow(pars_limit[ipar] - pars[ipar],2);
+      }
+      f *= (1+penalty/npar);
+      if(useCondition && std::isnan(condition)){
+        // on the first call, the morphing function only exists now
+        condition = instance->prescreen(pars_limit);
+      }
+      if(instance->conditionWeight > 0){
+        f += instance->conditionWeight * std::log10(condition);
+      }
+      if(std::isinf(f) || std::isnan(f)){
+        std::cout << "error: obtained non-numeric result" << std::endl;
+        f = std::numeric_limits<double>::max();
+        if(needGradient) std::fill(gin,gin+npar,0.);
+      } else if(needGradient){
+        instance->computeGradient(pars,pars_limit,score,gin);
+      }
+    }
+    if(f<instance->bestScore){
+      instance->bestScore = f;
+      instance->bestPars = pars;
     }
-    if(f<RooLagrangianMorphOptimizer::gActiveInstance->bestScore) RooLagrangianMorphOptimizer::gActiveInstance->bestScore = f;
   } catch(std::exception& e){
     std::cout << "error: " << e.what() << std::endl;
     f = std::numeric_limits<double>::max();
+    if(needGradient) std::fill(gin,gin+npar,0.);
   }
-  if(RooLagrangianMorphOptimizer::gActiveInstance->iterations % 1000 == 0){
-    std::cout<<"processing iteration "<<RooLagrangianMorphOptimizer::gActiveInstance->iterations<<"..."<<std::endl;
+  if(instance->iterations % 1000 == 0){
+    std::cout<<"processing iteration "<<instance->iterations<<"..."<<std::endl;
   }
-  if(f==RooLagrangianMorphOptimizer::gActiveInstance->bestScore){
-    RooLagrangianMorphOptimizer::gActiveInstance->printResult(pars,f);
+  if(f==instance->bestScore){
+    instance->printResult(pars,f);
   }
 
-  ++RooLagrangianMorphOptimizer::gActiveInstance->iterations;
+  instance->logIteration(wallTime()-fcnStart,setupTime,buildTime,inversionTime,f);
+
+  ++instance->iterations;
+  if(instance->checkpointfilename.Length() > 0 && instance->checkpointInterval > 0 && instance->iterations % instance->checkpointInterval == 0){
+    instance->writeCheckpoint(instance->checkpointfilename);
+  }
+}
+
+void RooLagrangianMorphOptimizer::setLog(const char* filename){
+  // write one line per evaluation of the target function to a CSV file
+  // times are wall times in seconds, an empty filename disables the log
+  delete this->fcnLog;
+  this->fcnLog = NULL;
+  if(!filename || !filename[0]) return;
+  this->fcnLog = new std::ofstream(filename);
+  if(!this->fcnLog->good()){
+    delete this->fcnLog;
+    this->fcnLog = NULL;
+    ERROR("unable to open log file '" << filename << "'!");
+    return;
+  }
+  this->startTime = wallTime();
+  (*this->fcnLog) << "iteration,walltime,fcntime,setuptime,buildtime,inversiontime,score,bestscore" << std::endl;
+  this->fcnLog->precision(std::numeric_limits<double>::max_digits10);
+}
+
+void RooLagrangianMorphOptimizer::logIteration(double fcnTime, double setupTime, double buildTime, double inversionTime, double score){
+  // write a line to the log
+  if(!this->fcnLog) return;
+  (*this->fcnLog) << this->iterations << ","
+                  << wallTime()-this->startTime << ","
+                  << fcnTime << ","
+                  << setupTime << ","
+                  << buildTime << ","
+                  << inversionTime << ","
+                  << score << ","
+                  << this->bestScore << "\n";
+}
+
+void RooLagrangianMorphOptimizer::setCheckpoint(const char* filename, int every){
+  // write the state of the optimizer to a file every few evaluations of the target function
+  // and at every stage of the minimization, such that it can be resumed with resume()
+  // an empty filename disables checkpointing
+  this->checkpointfilename = filename ? filename : "";
+  this->checkpointInterval = every;
+}
+
+void RooLagrangianMorphOptimizer::writeCheckpoint(const char* filename){
+  // write the state of the optimizer to a file
+  // the file is written to a temporary first and moved into place, such
+  // that an interruption never leaves a truncated checkpoint behind
+  const TString tmpname = TString::Format("%s.tmp",filename);
+  {
+    std::ofstream out(tmpname.Data());
+    if(!out.good()){
+      ERROR("unable to write checkpoint file '" << tmpname << "'!");
+      return;
+    }
+    out.precision(std::numeric_limits<double>::max_digits10);
+    const size_t npars = this->fnSamples*this->fnfreeParameters;
+    out << "# RooLagrangianMorphOptimizer checkpoint" << std::endl;
+    out << "stage " << (this->stage.Length() > 0 ? this->stage.Data() : "none") << std::endl;
+    out << "iterations " << this->iterations << std::endl;
+    out << "bestScore " << this->bestScore << std::endl;
+    out << "nparameters " << npars << std::endl;
+    out << "current";
+    std::vector<double> steps(npars,0.);
+    for(size_t i=0; i<npars; ++i){
+      double val = 0;
+      this->ptMinuit->GetParameter(i,val,steps[i]);
+      out << " " << val;
+    }
+    out << std::endl << "steps";
+    for(size_t i=0; i<npars; ++i){
+      out << " " << steps[i];
+    }
+    out << std::endl << "best";
+    for(size_t i=0; i<this->bestPars.size(); ++i){
+      out << " " << this->bestPars[i];
+    }
+    out << std::endl;
+    if(!out.good()){
+      ERROR("error while writing checkpoint file '" << tmpname << "'!");
+      return;
+    }
+  }
+  if(std::rename(tmpname.Data(),filename) != 0){
+    ERROR("unable to move checkpoint file to '" << filename << "'!");
+  }
+}
+
+bool RooLagrangianMorphOptimizer::resume(const char* filename){
+  // restore the state of the optimizer from a checkpoint file
+  // minuit is restarted from the best parameters found so far, using the
+  // last known parameter uncertainties as step sizes. optimize() then
+  // skips the stages of the minimization that were already completed
+  std::ifstream in(filename);
+  if(!in.good()){
+    ERROR("unable to open checkpoint file '" << filename << "'!");
+    return false;
+  }
+  const size_t npars = this->fnSamples*this->fnfreeParameters;
+  std::vector<double> current, steps, best;
+  std::string line;
+  while(std::getline(in,line)){
+    std::istringstream iss(line);
+    std::string key;
+    iss >> key;
+    if(key.empty() || key[0] == '#') continue;
+    if(key == "stage"){
+      std::string s;
+      iss >> s;
+      this->stage = (s == "none" ? "" : s.c_str());
+    } else if(key == "iterations"){
+      iss >> this->iterations;
+    } else if(key == "bestScore"){
+      iss >> this->bestScore;
+    } else if(key == "nparameters"){
+      size_t n = 0;
+      iss >> n;
+      if(n != npars){
+        ERROR("checkpoint file '" << filename << "' has " << n << " parameters, expected " << npars);
+        return false;
+      }
+    } else {
+      std::vector<double> values;
+      double v;
+      while(iss >> v) values.push_back(v);
+      if(key == "current") current = values;
+      else if(key == "steps") steps = values;
+      else if(key == "best") best = values;
+    }
+  }
+  if(current.size() != npars || steps.size() != npars){
+    ERROR("checkpoint file '" << filename << "' is incomplete!");
+    return false;
+  }
+  this->bestPars = best;
+  const std::vector<double>& start = (best.size() == npars ? best : current);
+  for(size_t i=0; i<this->fnSamples; ++i){
+    for(size_t j=0; j<this->fnfreeParameters; ++j){
+      const size_t ipar = i*this->fnfreeParameters+j;
+      TString parname = TString::Format("sample%03d_%s",int(i),this->parameternames[i][j].c_str());
+      // minuit reports no error for parameters it has not varied (yet),
+      // these fall back to the initial step size of the setup
+      if(!(steps[ipar] > 0)){
+        RooRealVar* p = this->xsHelper->getParameter(this->parameternames[i][j].c_str());
+        steps[ipar] = p ? fabs(0.5*(p->getMax()-p->getMin())) : 1.;
+      }
+      this->ptMinuit->mnparm(ipar, parname.Data(), start[ipar], steps[ipar], 0,0,ierflg);
+    }
+  }
+  this->setupMorphing(this->getParameterBounds(start));
+  return true;
+}
+
+void RooLagrangianMorphOptimizer::computeGradient(const std::vector<double>& pars, const std::vector<double>& pars_limit, double score, double* grad){
+  // assemble the gradient of the target function
+  // the parameters of sample j only enter row j of the morphing matrix M,
+  // such that dM = e_j * g^T with g the gradient of the monomials. with
+  // d(Inverse) = -Inverse*dM*Inverse, the weights w = Inverse^T*f of a
+  // benchmark change by dw = -w_j * Inverse^T*g, no re-inversion required
+  // the gradients of the monomials (getFormulaGradient) are analytic as well,
+  // and the cross sections of the samples follow from the inverse of the helper,
+  // which is converted once. the condition term varies only row j of the matrix
+  // along g, such that the polynomials are evaluated once per sample
+  // the parameters of the morphing function and the helper are restored afterwards
+  const RooLagrangianMorphing::ParamSet morphValues(this->morphFunc->getParameters());
+  const RooLagrangianMorphing::ParamSet helperValues(this->xsHelper->getParameters());
+  const size_t npars = pars.size();
+  const size_t nsamples = this->fnSamples;
+  const TMatrixD inverse(this->morphFunc->getInvertedMatrix());
+  if(size_t(inverse.GetNcols()) != nsamples){
+    ERROR("dimension of inverted matrix does not match the number of samples!");
+  }
+  const TMatrixD inverseHelper(this->xsHelper->getInvertedMatrix());
+
+  // collect the benchmark weights and the evaluator derivatives
+  std::vector<std::vector<double> > bweights;
+  std::vector<double> bunc, dEdV, dEdU;
+  for(const auto& b:this->benchmarks){
+    this->morphFunc->setParameters(b.name.Data());
+    const std::vector<double> formulas(this->morphFunc->getFormulaValues());
+    std::vector<double> w(nsamples,0.);
+    double val = 0;
+    double unc2 = 0;
+    for(size_t s=0; s<nsamples; ++s){
+      for(int k=0; k<inverse.GetNrows(); ++k){
+        w[s] += inverse(k,s) * formulas[k];
+      }
+      val  += w[s] * this->sampleXS[s];
+      unc2 += w[s] * w[s] * this->sampleXSUnc[s] * this->sampleXSUnc[s];
+    }
+    double dval,dunc;
+    this->evaluator->gradient(val,sqrt(unc2),b.xsection,b.uncertainty,dval,dunc);
+    bweights.push_back(w);
+    bunc.push_back(sqrt(unc2));
+    dEdV.push_back(dval);
+    dEdU.push_back(dunc);
+  }
+
+  // the cross sections of the samples are taken from the helper, which does not change
+  const std::vector<double> yieldsHelper(this->xsHelper->getSampleYields());
+  const std::vector<double> sumw2Helper(this->xsHelper->getSampleSumW2());
+
+  double penalty = 0.;
+  for(size_t ipar=0; ipar<npars; ipar++){
+    penalty += std::pow(pars_limit[ipar] - pars[ipar],2);
+  }
+
+  // rows of the morphing matrix and monomial gradients, only kept for the condition term
+  std::vector<double> matrix;
+  std::vector<std::vector<double> > dformulas(npars);
+
+  int iSample = 0;
+  for(const auto& name:this->temporaries){
+    TFolder* f = dynamic_cast<TFolder*>(gDirectory->Get(name.Data()));
+    if(!f) continue;
+    TH1* param_card = (TH1*)(f->FindObject("param_card"));
+    this->morphFunc->setParameters(param_card);
+    this->xsHelper->setParameters(param_card);
+    for(size_t i=0; i<this->fnfreeParameters; ++i){
+      this->morphFunc->getParameter(this->parameternames[iSample][i].c_str())->setVal(pars_limit[iSample*this->fnfreeParameters+i]);
+    }
+    if(this->conditionWeight > 0){
+      const std::vector<double> row(this->morphFunc->getFormulaValues());
+      matrix.insert(matrix.end(),row.begin(),row.end());
+    }
+    const std::vector<double> weightsHelper(this->xsHelper->getWeightValues());
+    for(size_t i=0; i<this->fnfreeParameters; ++i){
+      const size_t ipar = iSample*this->fnfreeParameters+i;
+      // parameters beyond their bounds are clamped, and only enter via the penalty
+      double dscore = 0.;
+      if(pars_limit[ipar] == pars[ipar]){
+        const char* parname = this->parameternames[iSample][i].c_str();
+        // derivative of the cross section (and uncertainty) of this sample
+        const std::vector<double> dformulasHelper(this->xsHelper->getFormulaGradient(parname));
+        std::vector<double> dweightsHelper(inverseHelper.GetNcols(),0.);
+        for(int s=0; s<inverseHelper.GetNcols(); ++s){
+          for(int k=0; k<inverseHelper.GetNrows(); ++k){
+            dweightsHelper[s] += inverseHelper(k,s) * dformulasHelper[k];
+          }
+        }
+        double dxs = 0.;
+        double dunc2 = 0.;
+        for(size_t s=0; s<dweightsHelper.size(); ++s){
+          dxs   += dweightsHelper[s] * yieldsHelper[s];
+          dunc2 += 2 * weightsHelper[s] * dweightsHelper[s] * sumw2Helper[s];
+        }
+        const double xsunc = this->sampleXSUnc[iSample];
+        const double dxsunc = (this->presetUncertainty > 0 ? this->presetUncertainty * dxs : (xsunc > 0 ? 0.5 * dunc2 / xsunc : 0.));
+        // Inverse^T * g for the monomials of this sample
+        const std::vector<double> g(this->morphFunc->getFormulaGradient(parname));
+        std::vector<double> ig(nsamples,0.);
+        for(size_t s=0; s<nsamples; ++s){
+          for(int k=0; k<inverse.GetNrows(); ++k){
+            ig[s] += inverse(k,s) * g[k];
+          }
+        }
+        for(size_t b=0; b<bweights.size(); ++b){
+          const std::vector<double>& w = bweights[b];
+          const double wj = w[iSample];
+          double dval = wj * dxs;
+          double dunc = wj * wj * xsunc * dxsunc;
+          for(size_t s=0; s<nsamples; ++s){
+            const double dw = -wj * ig[s];
+            dval += dw * this->sampleXS[s];
+            dunc += w[s] * dw * this->sampleXSUnc[s] * this->sampleXSUnc[s];
+          }
+          if(bunc[b] > 0) dunc /= bunc[b];
+          else dunc = 0;
+          dscore += dEdV[b] * dval + dEdU[b] * dunc;
+        }
+        if(this->conditionWeight > 0) dformulas[ipar] = g;
+      }
+      grad[ipar] = dscore * (1+penalty/npars) - score * 2 * (pars_limit[ipar] - pars[ipar]) / npars;
+    }
+    ++iSample;
+  }
+
+  if(this->conditionWeight > 0 && iSample > 0){
+    // the condition estimate is cheap, differentiate it numerically along the
+    // analytic row variation instead of re-evaluating the polynomials
+    const size_t ncols = matrix.size() / iSample;
+    for(size_t ipar=0; ipar<npars; ++ipar){
+      const std::vector<double>& g = dformulas[ipar];
+      if(g.size() != ncols) continue;
+      const size_t offset = (ipar/this->fnfreeParameters)*ncols;
+      const double h = 1e-6*std::max(1.,fabs(pars[ipar]));
+      std::vector<double> up(matrix);
+      std::vector<double> dn(matrix);
+      for(size_t k=0; k<ncols; ++k){
+        up[offset+k] += h*g[k];
+        dn[offset+k] -= h*g[k];
+      }
+      grad[ipar] += this->conditionWeight * (std::log10(RooLagrangianMorphing::estimateCondition(up,iSample)) - std::log10(RooLagrangianMorphing::estimateCondition(dn,iSample))) / (2*h);
+    }
+  }
+  this->morphFunc->setParameters(morphValues);
+  this->xsHelper->setParameters(helperValues);
+}
+
+std::vector<double> RooLagrangianMorphOptimizer::getGradient(){
+  // calculate the gradient of the target function at the current parameters
+  std::vector<double> pars = getCurrentPars();
+  std::vector<double> grad(pars.size(),0.);
+  double f = 0;
+  int npars = pars.size();
+  targetFcn(npars, &(grad[0]), f, &(pars[0]), 2);
+  return grad;
 }
 
 void RooLagrangianMorphOptimizer::splitpath(const TString& input, TString& filename, TString& subpath){
@@ -268,6 +826,7 @@ RooLagrangianMorphOptimizer::RooLagrangianMorphOptimizer(const char* input, cons
 }
 
 RooLagrangianMorphOptimizer::~RooLagrangianMorphOptimizer(){
+  delete this->fcnLog;
   delete this->morphFunc;
   delete this->xsHelper;
   delete this->ptMinuit;
@@ -454,12 +1013,8 @@ std::vector<double> RooLagrangianMorphOptimizer::getCurrentPars(){
   return pars;
 }
 
-TGraph* RooLagrangianMorphOptimizer::makeLikelihoodGraph(const int& sample, const TString& parametername, const int n, const double modus){
-  // modus: e.g. modus =  0.01 -> plot in 1% of the maximal parameter range around the minimum
-  //             modus <= 0.   -> plot whole range
-  std::vector<double> pars = getCurrentPars();
-  std::vector<double> pars_start(pars);
-  int npars = this->temporaries.size()*this->fnfreeParameters;
+int RooLagrangianMorphOptimizer::getParameterIndex(const int& sample, const TString& parametername){
+  // obtain the index of a parameter of a sample in the list of free parameters
   int index = -1;
   for(size_t i=0; i<parameternames[sample].size();++i){
     if(parameternames[sample][i].compare(parametername.Data())==0){
@@ -468,11 +1023,18 @@ TGraph* RooLagrangianMorphOptimizer::makeLikelihoodGraph(const int& sample, cons
     }
   }
   if(index==-1) ERROR("Did not find parametername "<<parametername<<" in list of used parameters!");
-  int ipar = sample*this->fnfreeParameters + index;
+  return sample*this->fnfreeParameters + index;
+}
+
+void RooLagrangianMorphOptimizer::getScanRange(const int& sample, const TString& parametername, const double modus, double& min, double& max){
+  // modus: e.g. modus =  0.01 -> plot in 1% of the maximal parameter range around the minimum
+  //             modus <= 0.   -> plot whole range
+  std::vector<double> pars = getCurrentPars();
+  int ipar = this->getParameterIndex(sample,parametername);
   double parametervalue = pars[ipar];
   RooRealVar* parameter = this->xsHelper->getParameter(parametername.Data());
-  double min = std::min(parameter->getMin(),parametervalue);
-  double max = std::max(parameter->getMax(),parametervalue);
+  min = std::min(parameter->getMin(),parametervalue);
+  max = std::max(parameter->getMax(),parametervalue);
   if(modus<=0. || modus >=1.){
     double margin = (max-min)*0.05;
     min = min-margin;
@@ -482,22 +1044,271 @@ TGraph* RooLagrangianMorphOptimizer::makeLikelihoodGraph(const int& sample, cons
     min = parametervalue-margin;
     max = parametervalue+margin;
   }
+}
+
+void RooLagrangianMorphOptimizer::setNumThreads(int n){
+  // set the number of threads used for scans, 0 uses all available cores
+  this->nThreads = n;
+}
+
+namespace {
+  struct ScanSnapshot {
+    // plain copy of everything needed to evaluate the target function
+    size_t nsamples;
+    std::vector<double> matrix; // row-major morphing matrix
+    std::vector<double> xs;
+    std::vector<double> unc;
+    std::vector<std::vector<double> > benchmarkFormulas;
+    bool useCondition;
+  };
+  // same threshold as the sanity check of the morphing matrix inversion
+  const double gScanUnityTolerance = 10e-6;
+  struct ScanPoint {
+    // rows of the morphing matrix that differ from the snapshot
+    std::vector<size_t> rows;
+    std::vector<std::vector<double> > formulas;
+    std::vector<double> xs;
+    std::vector<double> unc;
+    double penalty;
+    double condition;
+    // points with the wrong number of parameters or an unstable inversion are not evaluated
+    bool valid;
+    bool unstable;
+    // morphed prediction at the benchmarks
+    std::vector<double> values;
+    std::vector<double> uncertainties;
+  };
+
+  void evaluateScanPoints(const ScanSnapshot& snap, std::vector<ScanPoint>& points, size_t first, size_t last){
+    // evaluate the morphing at the benchmarks for a range of scan points
+    // this only touches the snapshot and the given points, and is safe to run concurrently
+    const size_t n = snap.nsamples;
+    const size_t nb = snap.benchmarkFormulas.size();
+    for(size_t i=first; i<last; ++i){
+      ScanPoint& p = points[i];
+      p.values.assign(nb,std::numeric_limits<double>::quiet_NaN());
+      p.uncertainties.assign(nb,std::numeric_limits<double>::quiet_NaN());
+      if(!p.valid) continue;
+      std::vector<double> m(snap.matrix);
+      std::vector<double> xs(snap.xs);
+      std::vector<double> unc(snap.unc);
+      for(size_t r=0; r<p.rows.size(); ++r){
+        const size_t row = p.rows[r];
+        std::copy(p.formulas[r].begin(),p.formulas[r].end(),m.begin()+row*n);
+        xs[row] = p.xs[r];
+        unc[row] = p.unc[r];
+      }
+      if(snap.useCondition) p.condition = RooLagrangianMorphing::estimateCondition(m,n);
+      // use the inversion of the morphing itself (precision and equilibration),
+      // such that the scan agrees with a full evaluation of the target function
+      std::vector<double> inverse;
+      double unityDeviation = 0.;
+      if(!RooLagrangianMorphing::invertFlatMatrix(m,n,inverse,&unityDeviation)) continue;
+      if(!(unityDeviation <= gScanUnityTolerance)){
+        p.unstable = true;
+        continue;
+      }
+      for(size_t b=0; b<nb; ++b){
+        const std::vector<double>& f = snap.benchmarkFormulas[b];
+        double val = 0.;
+        double unc2 = 0.;
+        for(size_t s=0; s<n; ++s){
+          double w = 0.;
+          for(size_t k=0; k<n; ++k){
+            w += inverse[k*n+s] * f[k];
+          }
+          val  += w * xs[s];
+          unc2 += w * w * unc[s] * unc[s];
+        }
+        p.values[b] = val;
+        p.uncertainties[b] = sqrt(unc2);
+      }
+    }
+  }
+}
+
+std::vector<double> RooLagrangianMorphOptimizer::scan(const std::vector<std::vector<double> >& points){
+  // evaluate the target function at many independent points in parameter space
+  // the morphing is set up once at the current parameters. the rows of the
+  // morphing matrix that differ from this state are prepared serially, since
+  // the RooFit objects are not thread safe, while the inversion and the
+  // morphing at the benchmarks runs in parallel on private copies.
+  // the evaluator is only ever called from the calling thread.
+  // the parameters of the morphing function and the helper are restored afterwards,
+  // a morphing function that is only created by the setup has no state to restore
+  const RooLagrangianMorphing::ParamSet morphValues(this->morphFunc ? this->morphFunc->getParameters() : RooLagrangianMorphing::ParamSet());
+  const RooLagrangianMorphing::ParamSet helperValues(this->xsHelper->getParameters());
+  const std::vector<double> start = getCurrentPars();
+  const size_t npars = start.size();
+  const std::vector<double> start_limit = this->getParameterBounds(start);
+  this->setupMorphing(start_limit);
+
+  ScanSnapshot snap;
+  snap.nsamples = this->fnSamples;
+  const TMatrixD matrix(this->morphFunc->getMatrix());
+  if(size_t(matrix.GetNrows()) != snap.nsamples || size_t(matrix.GetNcols()) != snap.nsamples){
+    ERROR("dimension of morphing matrix does not match the number of samples!");
+  }
+  snap.matrix.assign(matrix.GetMatrixArray(),matrix.GetMatrixArray()+snap.nsamples*snap.nsamples);
+  snap.xs = this->sampleXS;
+  snap.unc = this->sampleXSUnc;
+  snap.useCondition = (this->conditionWeight > 0 || this->conditionThreshold > 0);
+  for(const auto& b:this->benchmarks){
+    this->morphFunc->setParameters(b.name.Data());
+    snap.benchmarkFormulas.push_back(this->morphFunc->getFormulaValues());
+  }
+
+  std::vector<TH1*> paramCards;
+  for(const auto& name:this->temporaries){
+    TFolder* f = dynamic_cast<TFolder*>(gDirectory->Get(name.Data()));
+    if(!f) continue;
+    paramCards.push_back((TH1*)(f->FindObject("param_card")));
+  }
+
+  // prepare the modified rows of all scan points
+  std::vector<ScanPoint> scanpoints(points.size());
+  for(size_t i=0; i<points.size(); ++i){
+    ScanPoint& p = scanpoints[i];
+    p.penalty = 0.;
+    p.condition = std::numeric_limits<double>::quiet_NaN();
+    p.valid = (points[i].size() == npars);
+    p.unstable = false;
+    if(!p.valid){
+      ERROR("scan point " << i << " has " << points[i].size() << " parameters, expected " << npars);
+      continue;
+    }
+    const std::vector<double> limit = this->getParameterBounds(points[i]);
+    for(size_t ipar=0; ipar<npars; ++ipar){
+      p.penalty += std::pow(limit[ipar] - points[i][ipar],2);
+    }
+    for(size_t s=0; s<paramCards.size(); ++s){
+      bool modified = false;
+      for(size_t j=0; j<this->fnfreeParameters; ++j){
+        if(limit[s*this->fnfreeParameters+j] != start_limit[s*this->fnfreeParameters+j]) modified = true;
+      }
+      if(!modified) continue;
+      this->morphFunc->setParameters(paramCards[s]);
+      this->xsHelper->setParameters(paramCards[s]);
+      for(size_t j=0; j<this->fnfreeParameters; ++j){
+        const char* parname = this->parameternames[s][j].c_str();
+        this->morphFunc->getParameter(parname)->setVal(limit[s*this->fnfreeParameters+j]);
+        this->xsHelper->getParameter(parname)->setVal(limit[s*this->fnfreeParameters+j]);
+      }
+      const double xs = this->xsHelper->expectedEvents();
+      p.rows.push_back(s);
+      p.formulas.push_back(this->morphFunc->getFormulaValues());
+      p.xs.push_back(xs);
+      p.unc.push_back(this->presetUncertainty > 0 ? this->presetUncertainty * xs : this->xsHelper->expectedUncertainty());
+    }
+  }
+
+  // the workers must not fail, check the inversion settings beforehand
+  if(!RooLagrangianMorphing::isPrecisionAvailable(RooLagrangianMorphing::gInversionPrecision)){
+    this->morphFunc->setParameters(morphValues);
+    this->xsHelper->setParameters(helperValues);
+    ERROR("precision '" << RooLagrangianMorphing::getPrecisionName(RooLagrangianMorphing::gInversionPrecision) << "' is not available in this build!");
+    return std::vector<double>(points.size(),std::numeric_limits<double>::max());
+  }
+
+  // distribute the scan points over the threads
+  size_t nthreads = this->nThreads > 0 ? this->nThreads : std::max(1u,std::thread::hardware_concurrency());
+  nthreads = std::max(size_t(1),std::min(nthreads,scanpoints.size()));
+  const size_t chunk = (scanpoints.size() + nthreads - 1) / nthreads;
+  std::vector<std::thread> workers;
+  for(size_t t=0; t<nthreads; ++t){
+    const size_t first = t*chunk;
+    const size_t last = std::min(first+chunk,scanpoints.size());
+    if(first >= last) break;
+    workers.push_back(std::thread(evaluateScanPoints,std::cref(snap),std::ref(scanpoints),first,last));
+  }
+  for(auto& w:workers){
+    w.join();
+  }
+  this->morphFunc->setParameters(morphValues);
+  this->xsHelper->setParameters(helperValues);
+
+  // combine the predictions to the score
+  // invalid and unstable points are scored as the worst possible value
+  std::vector<double> scores(scanpoints.size(),0.);
+  size_t nunstable = 0;
+  for(size_t i=0; i<scanpoints.size(); ++i){
+    const ScanPoint& p = scanpoints[i];
+    if(!p.valid || p.unstable){
+      if(p.unstable) ++nunstable;
+      scores[i] = std::numeric_limits<double>::max();
+      continue;
+    }
+    double f = 0.;
+    for(size_t b=0; b<this->benchmarks.size(); ++b){
+      f += (*(this->evaluator))(p.values[b],p.uncertainties[b],this->benchmarks[b].xsection,this->benchmarks[b].uncertainty);
+    }
+    f *= (1+p.penalty/npars);
+    if(this->conditionWeight > 0){
+      f += this->conditionWeight * std::log10(p.condition);
+    }
+    if(this->conditionThreshold > 0 && p.condition > this->conditionThreshold){
+      f = std::numeric_limits<double>::max();
+    }
+    if(std::isinf(f) || std::isnan(f)){
+      f = std::numeric_limits<double>::max();
+    }
+    scores[i] = f;
+  }
+  if(nunstable > 0){
+    std::cerr << "Warning: the matrix inversion was unstable for " << nunstable << " of " << scanpoints.size() << " scan points, they are scored as invalid." << std::endl;
+  }
+  return scores;
+}
+
+TGraph* RooLagrangianMorphOptimizer::makeLikelihoodGraph(const int& sample, const TString& parametername, const int n, const double modus){
+  // modus: e.g. modus =  0.01 -> plot in 1% of the maximal parameter range around the minimum
+  //             modus <= 0.   -> plot whole range
+  const int ipar = this->getParameterIndex(sample,parametername);
+  double min,max;
+  this->getScanRange(sample,parametername,modus,min,max);
+  const std::vector<double> pars = getCurrentPars();
+  std::vector<std::vector<double> > points(n,pars);
   std::vector<Double_t> x = std::vector<Double_t>(n);
-  std::vector<Double_t> y = std::vector<Double_t>(n);
   for (Int_t ipoint=0;ipoint<n;++ipoint){
     x[ipoint] = ipoint*(max-min)/n+min;
-    pars[ipar] = x[ipoint];
-    double f = 0;
-    targetFcn(npars, NULL, f, &(pars[0]), 0);
-    y[ipoint] = f;
-    // std::cout<<"sample: "<<sample<<" freepar: "<<parametername<<",i: "<<ipoint<<" "<<x[ipoint]<<" "<<y[ipoint]<<std::endl;
-  }
-  // reset values in param_card
-  double f;
-  targetFcn(npars, NULL, f, &(pars_start[0]), 0);
+    points[ipoint][ipar] = x[ipoint];
+  }
+  std::vector<Double_t> y = this->scan(points);
   return new TGraph(n,&x[0],&y[0]);
 }
 
+TH2* RooLagrangianMorphOptimizer::makeLikelihoodHistogram(const int& sampleX, const TString& parameterX, const int& sampleY, const TString& parameterY, const int nx, const int ny, const double modus){
+  // scan the target function in two parameters, evaluated at the bin centers
+  // modus: as for makeLikelihoodGraph, applied to both axes
+  const int iparX = this->getParameterIndex(sampleX,parameterX);
+  const int iparY = this->getParameterIndex(sampleY,parameterY);
+  if(iparX == iparY){
+    ERROR("cannot scan parameter " << parameterX << " against itself!");
+  }
+  double xmin,xmax,ymin,ymax;
+  this->getScanRange(sampleX,parameterX,modus,xmin,xmax);
+  this->getScanRange(sampleY,parameterY,modus,ymin,ymax);
+  TH2* hist = new TH2D(TString::Format("likelihood_%d_%s_%d_%s",sampleX,parameterX.Data(),sampleY,parameterY.Data()),
+                       TString::Format(";%s (sample %d);%s (sample %d)",parameterX.Data(),sampleX,parameterY.Data(),sampleY),
+                       nx,xmin,xmax,ny,ymin,ymax);
+  hist->SetDirectory(NULL);
+  const std::vector<double> pars = getCurrentPars();
+  std::vector<std::vector<double> > points(nx*ny,pars);
+  for(int ix=0; ix<nx; ++ix){
+    for(int iy=0; iy<ny; ++iy){
+      points[ix*ny+iy][iparX] = hist->GetXaxis()->GetBinCenter(ix+1);
+      points[ix*ny+iy][iparY] = hist->GetYaxis()->GetBinCenter(iy+1);
+    }
+  }
+  const std::vector<double> scores = this->scan(points);
+  for(int ix=0; ix<nx; ++ix){
+    for(int iy=0; iy<ny; ++iy){
+      hist->SetBinContent(ix+1,iy+1,scores[ix*ny+iy]);
+    }
+  }
+  return hist;
+}
+
 RooLagrangianMorphOptimizer::ParamCardSet RooLagrangianMorphOptimizer::readParamCards(const char* ifname, const ParamCard& defaultvalues){
   ParamCardSet params;
   std::ifstream infile(ifname);
@@ -700,13 +1511,30 @@ int RooLagrangianMorphOptimizer::optimize(){
   ptMinuit->SetPrintLevel();
   // set the user function that calculates chi_square (the value to minimize)
   ptMinuit->SetFCN(targetFcn);
+  if(this->useGradient){
+    // let minuit use the analytic gradient provided by targetFcn instead of numerical derivatives
+    Double_t arglist[1] = {1.};
+    ptMinuit->mnexcm("SET GRA",arglist,1,ierflg);
+  }
 
   // DISCLAIMER:
   // I don't understand any of this arcane BS. I stole it from here: 
   // http://tesla.desy.de/~pcastro/example_progs/fit/minuit_c_style/fit_minuit.cxx
 
-  ptMinuit->mnsimp();
-  ptMinuit->mnmigr();
+  if(this->stage != "migrad" && this->stage != "done"){
+    this->stage = "simplex";
+    if(this->checkpointfilename.Length() > 0) this->writeCheckpoint(this->checkpointfilename);
+    ptMinuit->mnsimp();
+  }
+  if(this->stage != "done"){
+    this->stage = "migrad";
+    if(this->checkpointfilename.Length() > 0) this->writeCheckpoint(this->checkpointfilename);
+    ptMinuit->mnmigr();
+  }
+  this->stage = "done";
+  if(this->checkpointfilename.Length() > 0) this->writeCheckpoint(this->checkpointfilename);
+  this->stage = "";
+  if(this->fcnLog) this->fcnLog->flush();
 
   // Print results
   std::cout << "\nPrint results from minuit\n";
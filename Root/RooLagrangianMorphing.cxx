@@ -35,6 +35,9 @@
 
 // plain ROOT includes
 #include "TH1.h"
+#include "TH2.h"
+#include "TH3.h"
+#include "THnBase.h"
 #include "TParameter.h"
 #include "TFile.h"
 #include "TKey.h"
@@ -43,17 +46,25 @@
 #include "TCanvas.h"
 #include "TRandom3.h"
 #include "TMatrixD.h"
+#include "TDecompSVD.h"
 #include "TRegexp.h"
 
 // stl includes
 #include <map>
+#include <list>
+#include <set>
 #include <sstream>
+#include <iomanip>
 #include <stdexcept>
 #include <algorithm>
 #include <cstddef>
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <functional>
 
 #include <typeinfo>
 
@@ -74,6 +85,10 @@ ClassImpT(RooLagrangianMorphing::RooLagrangianMorphBase,T)
 #define DEBUG(arg)
 #endif
 bool RooLagrangianMorphing::gAllowExceptions = true;
+RooLagrangianMorphing::Precision RooLagrangianMorphing::gInversionPrecision = RooLagrangianMorphing::DefaultPrecision;
+RooLagrangianMorphing::Precision RooLagrangianMorphing::gEvaluationPrecision = RooLagrangianMorphing::DefaultPrecision;
+bool RooLagrangianMorphing::gEquilibrate = true;
+bool RooLagrangianMorphing::gLeastSquares = false;
 #define ERROR(arg){                                                     \
   if(RooLagrangianMorphing::gAllowExceptions){                                \
     std::stringstream err; err << arg << std::endl; throw(std::runtime_error(err.str())); \
@@ -90,6 +105,12 @@ template <> inline size_t size<TMatrixD> (const TMatrixD& mat){
   // retrieve the size of a square matrix
   return mat.GetNrows();
 }
+template<class MatrixT>
+inline size_t ncols(const MatrixT& matrix);
+template <> inline size_t ncols<TMatrixD> (const TMatrixD& mat){
+  // retrieve the number of columns of a matrix
+  return mat.GetNcols();
+}
 using namespace std;
 
 #include "RooLagrangianMorphing/LinearCombination.h"
@@ -98,11 +119,11 @@ template<class MatrixT>
 inline void writeMatrixToStreamT(const MatrixT& matrix, std::ostream& stream){
   // write a matrix to a stream
   for(size_t i=0; i<size(matrix); ++i){
-    for(size_t j=0; j<size(matrix); ++j){
+    for(size_t j=0; j<ncols(matrix); ++j){
 #ifdef USE_UBLAS
       stream << std::setprecision(RooLagrangianMorphing::SuperFloatPrecision::digits10) << matrix(i,j) << "\t";
 #else
-      stream << matrix(i,j) << "\t";
+      stream << std::setprecision(std::numeric_limits<double>::max_digits10) << matrix(i,j) << "\t";
 #endif
     }
     stream << std::endl;
@@ -148,6 +169,10 @@ template <> inline size_t size<Matrix> (const Matrix& matrix){
   // retrieve the size of a square matrix
   return matrix.size1();
 }
+template <> inline size_t ncols<Matrix> (const Matrix& matrix){
+  // retrieve the number of columns of a matrix
+  return matrix.size2();
+}
 inline Matrix diagMatrix(size_t n){
   // create a new diagonal matrix of size n
   return boost::numeric::ublas::identity_matrix<RooLagrangianMorphing::SuperFloat>(n);
@@ -155,9 +180,10 @@ inline Matrix diagMatrix(size_t n){
 inline TMatrixD makeRootMatrix(const Matrix& in){
   // convert a matrix into a TMatrixD
   size_t n = size(in);
-  TMatrixD mat(n,n);
+  size_t m = ncols(in);
+  TMatrixD mat(n,m);
   for(size_t i=0; i<n; ++i){
-    for(size_t j=0; j<n; ++j){
+    for(size_t j=0; j<m; ++j){
       mat(i,j) = (double)(in(i,j));
     }
   }
@@ -166,9 +192,10 @@ inline TMatrixD makeRootMatrix(const Matrix& in){
 inline Matrix makeSuperMatrix(const TMatrixD& in){
   // convert a TMatrixD into a Matrix
   size_t n = in.GetNrows();
-  Matrix mat(n,n);
+  size_t m = in.GetNcols();
+  Matrix mat(n,m);
   for(size_t i=0; i<n; ++i){
-    for(size_t j=0; j<n; ++j){
+    for(size_t j=0; j<m; ++j){
       mat(i,j) = in(i,j);
     }
   }
@@ -240,6 +267,671 @@ inline double invertMatrix(const Matrix& matrix, Matrix& inverse){
 }
 #endif
 
+namespace {
+  //_____________________________________________________________________________
+  // generic numeric kernels used to run the inversion and the weight
+  // evaluation in a precision chosen at runtime
+
+  struct DoubleDouble {
+    // unevaluated sum of two doubles, giving roughly 32 significant digits
+    double hi;
+    double lo;
+    DoubleDouble(double h = 0., double l = 0.) : hi(h), lo(l) {}
+    explicit operator double() const { return hi + lo; }
+  };
+  inline DoubleDouble quickTwoSum(double a, double b){
+    // error-free sum, assuming |a| >= |b|
+    const double s = a + b;
+    return DoubleDouble(s, b - (s - a));
+  }
+  inline DoubleDouble twoSum(double a, double b){
+    // error-free sum of two doubles
+    const double s = a + b;
+    const double bb = s - a;
+    return DoubleDouble(s, (a - (s - bb)) + (b - bb));
+  }
+  inline DoubleDouble operator+ (const DoubleDouble& a, const DoubleDouble& b){
+    DoubleDouble s = twoSum(a.hi, b.hi);
+    const DoubleDouble t = twoSum(a.lo, b.lo);
+    s.lo += t.hi;
+    s = quickTwoSum(s.hi, s.lo);
+    s.lo += t.lo;
+    return quickTwoSum(s.hi, s.lo);
+  }
+  inline DoubleDouble operator- (const DoubleDouble& a){
+    return DoubleDouble(-a.hi, -a.lo);
+  }
+  inline DoubleDouble operator- (const DoubleDouble& a, const DoubleDouble& b){
+    return a + (-b);
+  }
+  inline DoubleDouble operator* (const DoubleDouble& a, const DoubleDouble& b){
+    const double p = a.hi * b.hi;
+    const double e = std::fma(a.hi, b.hi, -p) + (a.hi * b.lo + a.lo * b.hi);
+    return quickTwoSum(p, e);
+  }
+  inline DoubleDouble operator/ (const DoubleDouble& a, const DoubleDouble& b){
+    // long division, refining the quotient twice
+    const double q1 = a.hi / b.hi;
+    DoubleDouble r = a - b * DoubleDouble(q1);
+    const double q2 = r.hi / b.hi;
+    r = r - b * DoubleDouble(q2);
+    const double q3 = r.hi / b.hi;
+    return quickTwoSum(q1, q2) + DoubleDouble(q3);
+  }
+  inline bool operator< (const DoubleDouble& a, const DoubleDouble& b){
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+  }
+  inline bool operator== (const DoubleDouble& a, const DoubleDouble& b){
+    return a.hi == b.hi && a.lo == b.lo;
+  }
+
+#ifdef __SIZEOF_FLOAT128__
+  typedef __float128 QuadFloat;
+#endif
+
+  template<class T> inline T absValue(const T& x){
+    // absolute value for all supported number types
+    return x < T(0.) ? T(-x) : x;
+  }
+  template<class T> inline T sqrtValue(const T& x){
+    // square root for all supported number types, the double estimate is
+    // refined by Newton steps, each of which doubles the number of digits
+    if(!(T(0.) < x)) return T(0.);
+    T y(std::sqrt(static_cast<double>(x)));
+    for(int i=0; i<3; ++i) y = T(T(y + T(x / y)) * T(0.5));
+    return y;
+  }
+#ifdef USE_UBLAS
+  // storage type of inverses computed in a selectable precision, this is the
+  // element type of the morphing matrix such that no digits are lost
+  typedef RooLagrangianMorphing::SuperFloat WideFloat;
+#elif defined(__SIZEOF_FLOAT128__)
+  typedef QuadFloat WideFloat;
+#else
+  typedef DoubleDouble WideFloat;
+#endif
+
+  template<class To, class From> struct NumberConverter {
+    static To convert(const From& x){
+      // split into three doubles, carrying about 48 significant digits,
+      // which is more than any of the fixed-size types can hold
+      const double hi = static_cast<double>(x);
+      const From r = From(x - From(hi));
+      const double mid = static_cast<double>(r);
+      const double lo = static_cast<double>(From(r - From(mid)));
+      return To(To(To(hi) + To(mid)) + To(lo));
+    }
+  };
+  template<class T> struct NumberConverter<T,T> {
+    static T convert(const T& x){
+      return x;
+    }
+  };
+  template<class To, class From> inline To convertNumber(const From& x){
+    // convert between any of the supported number types
+    return NumberConverter<To,From>::convert(x);
+  }
+
+  //_____________________________________________________________________________
+
+  template<class T, class Out>
+  bool invertMatrixT(const std::vector<double>& matrix, size_t n, std::vector<Out>& inverse){
+    // Gauss-Jordan elimination with partial pivoting in the number type T,
+    // the result is stored in the number type Out
+    std::vector<T> a(n*n);
+    std::vector<T> inv(n*n, T(0.));
+    for(size_t i=0; i<n*n; ++i) a[i] = T(matrix[i]);
+    for(size_t i=0; i<n; ++i) inv[i*n+i] = T(1.);
+    for(size_t col=0; col<n; ++col){
+      size_t pivot = col;
+      T largest = absValue(a[col*n+col]);
+      for(size_t row=col+1; row<n; ++row){
+        const T val = absValue(a[row*n+col]);
+        if(largest < val){
+          largest = val;
+          pivot = row;
+        }
+      }
+      if(largest == T(0.)) return false;
+      if(pivot != col){
+        for(size_t j=0; j<n; ++j){
+          std::swap(a[pivot*n+j],a[col*n+j]);
+          std::swap(inv[pivot*n+j],inv[col*n+j]);
+        }
+      }
+      const T scale = T(T(1.) / a[col*n+col]);
+      for(size_t j=0; j<n; ++j){
+        a[col*n+j] = T(a[col*n+j] * scale);
+        inv[col*n+j] = T(inv[col*n+j] * scale);
+      }
+      for(size_t row=0; row<n; ++row){
+        if(row == col) continue;
+        const T factor = a[row*n+col];
+        if(factor == T(0.)) continue;
+        for(size_t j=0; j<n; ++j){
+          a[row*n+j] = T(a[row*n+j] - factor * a[col*n+j]);
+          inv[row*n+j] = T(inv[row*n+j] - factor * inv[col*n+j]);
+        }
+      }
+    }
+    inverse.resize(n*n);
+    for(size_t i=0; i<n*n; ++i) inverse[i] = convertNumber<Out>(inv[i]);
+    return true;
+  }
+
+  template<class T>
+  std::vector<double> evaluateWeightsT(const std::vector<WideFloat>& inverse, const std::vector<double>& formulas){
+    // evaluate the sample weights w_s = sum_k inverse(k,s) f_k in the number type T
+    const size_t n = formulas.size();
+    std::vector<T> coefficients(n*n);
+    for(size_t i=0; i<n*n; ++i) coefficients[i] = convertNumber<T>(inverse[i]);
+    std::vector<double> weights(n);
+    for(size_t s=0; s<n; ++s){
+      T sum(0.);
+      for(size_t k=0; k<n; ++k){
+        sum = T(sum + coefficients[k*n+s] * T(formulas[k]));
+      }
+      weights[s] = static_cast<double>(sum);
+    }
+    return weights;
+  }
+
+  inline RooLagrangianMorphing::Precision resolvePrecision(RooLagrangianMorphing::Precision precision){
+    // map the default onto the precision fixed at compile time
+    if(precision != RooLagrangianMorphing::DefaultPrecision) return precision;
+#ifdef USE_UBLAS
+    return RooLagrangianMorphing::MultiPrecision;
+#else
+    return RooLagrangianMorphing::DoublePrecision;
+#endif
+  }
+
+  template<class Out>
+  bool invertMatrixPrecision(const std::vector<double>& matrix, size_t n, RooLagrangianMorphing::Precision precision, std::vector<Out>& inverse){
+    // invert a matrix in the given precision
+    switch(resolvePrecision(precision)){
+    case RooLagrangianMorphing::DoublePrecision: return invertMatrixT<double>(matrix,n,inverse);
+    case RooLagrangianMorphing::LongDoublePrecision: return invertMatrixT<long double>(matrix,n,inverse);
+    case RooLagrangianMorphing::DoubleDoublePrecision: return invertMatrixT<DoubleDouble>(matrix,n,inverse);
+#ifdef __SIZEOF_FLOAT128__
+    case RooLagrangianMorphing::QuadPrecision: return invertMatrixT<QuadFloat>(matrix,n,inverse);
+#endif
+#ifdef USE_UBLAS
+    case RooLagrangianMorphing::MultiPrecision: return invertMatrixT<RooLagrangianMorphing::SuperFloat>(matrix,n,inverse);
+#endif
+    default:
+      ERROR("precision '" << RooLagrangianMorphing::getPrecisionName(precision) << "' is not available in this build!");
+    }
+    return false;
+  }
+
+  template<class T, class Out>
+  bool pseudoInvertMatrixT(const std::vector<double>& matrix, const std::vector<double>& rowScale, size_t nrows, size_t ncolumns, std::vector<Out>& pinv){
+    // least-squares pseudo-inverse P = R^-1 Q^T of the matrix A = D*M with
+    // full column rank, D being the diagonal row scale, via a Householder QR
+    // decomposition in the number type T, the result (ncolumns x nrows) is
+    // stored in the number type Out
+    std::vector<T> a(nrows*ncolumns);
+    for(size_t i=0; i<nrows; ++i){
+      for(size_t j=0; j<ncolumns; ++j) a[i*ncolumns+j] = T(T(matrix[i*ncolumns+j]) * T(rowScale[i]));
+    }
+    // the reflections are applied to the unit matrix alongside, giving Q^T
+    std::vector<T> qt(nrows*nrows,T(0.));
+    for(size_t i=0; i<nrows; ++i) qt[i*nrows+i] = T(1.);
+    std::vector<T> v(nrows);
+    for(size_t k=0; k<ncolumns; ++k){
+      T norm2(0.);
+      for(size_t i=k; i<nrows; ++i) norm2 = T(norm2 + a[i*ncolumns+k] * a[i*ncolumns+k]);
+      if(norm2 == T(0.)) return false;
+      // reflect the column onto -sign(a_kk)*|a|*e_k, which avoids cancellation
+      T alpha = sqrtValue(norm2);
+      if(T(0.) < a[k*ncolumns+k]) alpha = T(-alpha);
+      for(size_t i=k; i<nrows; ++i) v[i] = a[i*ncolumns+k];
+      v[k] = T(v[k] - alpha);
+      T vnorm2(0.);
+      for(size_t i=k; i<nrows; ++i) vnorm2 = T(vnorm2 + v[i] * v[i]);
+      const T beta = T(T(2.) / vnorm2);
+      for(size_t j=k; j<ncolumns; ++j){
+        T dot(0.);
+        for(size_t i=k; i<nrows; ++i) dot = T(dot + v[i] * a[i*ncolumns+j]);
+        dot = T(dot * beta);
+        for(size_t i=k; i<nrows; ++i) a[i*ncolumns+j] = T(a[i*ncolumns+j] - dot * v[i]);
+      }
+      for(size_t j=0; j<nrows; ++j){
+        T dot(0.);
+        for(size_t i=k; i<nrows; ++i) dot = T(dot + v[i] * qt[i*nrows+j]);
+        dot = T(dot * beta);
+        for(size_t i=k; i<nrows; ++i) qt[i*nrows+j] = T(qt[i*nrows+j] - dot * v[i]);
+      }
+    }
+    // back substitution of R*P = Q^T, restricted to the first ncolumns rows
+    pinv.resize(ncolumns*nrows);
+    std::vector<T> x(ncolumns);
+    for(size_t s=0; s<nrows; ++s){
+      for(size_t k=ncolumns; k-- > 0;){
+        T sum(qt[k*nrows+s]);
+        for(size_t l=k+1; l<ncolumns; ++l) sum = T(sum - a[k*ncolumns+l] * x[l]);
+        x[k] = T(sum / a[k*ncolumns+k]);
+      }
+      for(size_t k=0; k<ncolumns; ++k) pinv[k*nrows+s] = convertNumber<Out>(T(x[k] * T(rowScale[s])));
+    }
+    return true;
+  }
+
+  template<class Out>
+  bool pseudoInvertMatrixPrecision(const std::vector<double>& matrix, const std::vector<double>& rowScale, size_t nrows, size_t ncolumns, RooLagrangianMorphing::Precision precision, std::vector<Out>& pinv){
+    // calculate the least-squares pseudo-inverse of a matrix in the given precision
+    switch(resolvePrecision(precision)){
+    case RooLagrangianMorphing::DoublePrecision: return pseudoInvertMatrixT<double>(matrix,rowScale,nrows,ncolumns,pinv);
+    case RooLagrangianMorphing::LongDoublePrecision: return pseudoInvertMatrixT<long double>(matrix,rowScale,nrows,ncolumns,pinv);
+    case RooLagrangianMorphing::DoubleDoublePrecision: return pseudoInvertMatrixT<DoubleDouble>(matrix,rowScale,nrows,ncolumns,pinv);
+#ifdef __SIZEOF_FLOAT128__
+    case RooLagrangianMorphing::QuadPrecision: return pseudoInvertMatrixT<QuadFloat>(matrix,rowScale,nrows,ncolumns,pinv);
+#endif
+#ifdef USE_UBLAS
+    case RooLagrangianMorphing::MultiPrecision: return pseudoInvertMatrixT<RooLagrangianMorphing::SuperFloat>(matrix,rowScale,nrows,ncolumns,pinv);
+#endif
+    default:
+      ERROR("precision '" << RooLagrangianMorphing::getPrecisionName(precision) << "' is not available in this build!");
+    }
+    return false;
+  }
+
+  std::vector<double> evaluateWeightsPrecision(const std::vector<WideFloat>& inverse, const std::vector<double>& formulas, RooLagrangianMorphing::Precision precision){
+    // evaluate the sample weights in the given precision
+    switch(resolvePrecision(precision)){
+    case RooLagrangianMorphing::DoublePrecision: return evaluateWeightsT<double>(inverse,formulas);
+    case RooLagrangianMorphing::LongDoublePrecision: return evaluateWeightsT<long double>(inverse,formulas);
+    case RooLagrangianMorphing::DoubleDoublePrecision: return evaluateWeightsT<DoubleDouble>(inverse,formulas);
+#ifdef __SIZEOF_FLOAT128__
+    case RooLagrangianMorphing::QuadPrecision: return evaluateWeightsT<QuadFloat>(inverse,formulas);
+#endif
+#ifdef USE_UBLAS
+    case RooLagrangianMorphing::MultiPrecision: return evaluateWeightsT<RooLagrangianMorphing::SuperFloat>(inverse,formulas);
+#endif
+    default:
+      ERROR("precision '" << RooLagrangianMorphing::getPrecisionName(precision) << "' is not available in this build!");
+    }
+    return std::vector<double>();
+  }
+
+  inline std::vector<double> flattenMatrix(const Matrix& matrix){
+    // copy a matrix into a row-major array of doubles
+    const size_t n = size(matrix);
+    std::vector<double> flat(n*n);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        flat[i*n+j] = static_cast<double>(matrix(i,j));
+      }
+    }
+    return flat;
+  }
+
+  inline double unityDeviationPrecision(const std::vector<double>& matrix, const std::vector<WideFloat>& inverse, size_t n){
+    // largest deviation of matrix*inverse from unity, computed in the storage precision
+    double deviation = 0.;
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        WideFloat sum(i == j ? -1. : 0.);
+        for(size_t k=0; k<n; ++k){
+          sum = WideFloat(sum + WideFloat(matrix[i*n+k]) * inverse[k*n+j]);
+        }
+        deviation = std::max(deviation,std::fabs(static_cast<double>(sum)));
+      }
+    }
+    return deviation;
+  }
+
+  double invertMatrix(const Matrix& matrix, Matrix& inverse, RooLagrangianMorphing::Precision precision){
+    // calculate the inverse of a matrix in the given precision, returning the
+    // condition, the default is the implementation fixed at compile time
+    if(precision == RooLagrangianMorphing::DefaultPrecision) return (double)(::invertMatrix(matrix,inverse));
+    const size_t n = size(matrix);
+    const std::vector<double> flat(flattenMatrix(matrix));
+    // the result is stored in the element type of the matrix directly
+    std::vector<RooLagrangianMorphing::SuperFloat> result;
+    if(!invertMatrixPrecision(flat,n,precision,result)){
+      std::cout << std::endl;
+      printMatrix(matrix);
+      ERROR("Error: matrix is not invertible!");
+      return 0.;
+    }
+    double mnorm = 0.;
+    double inorm = 0.;
+    for(size_t i=0; i<n; ++i){
+      double mrow = 0.;
+      double irow = 0.;
+      for(size_t j=0; j<n; ++j){
+        mrow += std::fabs(flat[i*n+j]);
+        irow += std::fabs(static_cast<double>(result[i*n+j]));
+        inverse(i,j) = result[i*n+j];
+      }
+      mnorm = std::max(mnorm,mrow);
+      inorm = std::max(inorm,irow);
+    }
+    return mnorm * inorm;
+  }
+
+  //_____________________________________________________________________________
+
+  inline double powerOfTwoBelow(double x){
+    // largest power of two not exceeding x, such that scaling is exact
+    int exponent;
+    std::frexp(x,&exponent);
+    return std::ldexp(1.,exponent-1);
+  }
+
+  void computeEquilibration(const std::vector<double>& matrix, size_t n, std::vector<double>& rowScale, std::vector<double>& colScale){
+    // find row and column scale factors (powers of two) bringing the largest
+    // entry of every row and column of the matrix close to unity
+    rowScale.assign(n,1.);
+    colScale.assign(n,1.);
+    for(int sweep=0; sweep<4; ++sweep){
+      for(size_t i=0; i<n; ++i){
+        double largest = 0.;
+        for(size_t j=0; j<n; ++j) largest = std::max(largest,std::fabs(matrix[i*n+j]*rowScale[i]*colScale[j]));
+        if(largest > 0.) rowScale[i] *= powerOfTwoBelow(1./largest);
+      }
+      for(size_t j=0; j<n; ++j){
+        double largest = 0.;
+        for(size_t i=0; i<n; ++i) largest = std::max(largest,std::fabs(matrix[i*n+j]*rowScale[i]*colScale[j]));
+        if(largest > 0.) colScale[j] *= powerOfTwoBelow(1./largest);
+      }
+    }
+  }
+
+  double invertMatrixEquilibrated(const Matrix& matrix, Matrix& inverse, RooLagrangianMorphing::Precision precision){
+    // invert the equilibrated matrix R*M*C, the inverse of M is C*inverse(R*M*C)*R
+    // the returned condition is the one of the equilibrated matrix
+    const size_t n = size(matrix);
+    std::vector<double> rowScale, colScale;
+    computeEquilibration(flattenMatrix(matrix),n,rowScale,colScale);
+    Matrix scaled(matrix);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        scaled(i,j) *= rowScale[i]*colScale[j];
+      }
+    }
+    const double condition = invertMatrix(scaled,inverse,precision);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        inverse(i,j) *= colScale[i]*rowScale[j];
+      }
+    }
+    return condition;
+  }
+
+  inline double invertMatrixSingle(const Matrix& matrix, Matrix& inverse, RooLagrangianMorphing::Precision precision){
+    // invert a matrix, equilibrating it if requested
+    if(RooLagrangianMorphing::gEquilibrate) return invertMatrixEquilibrated(matrix,inverse,precision);
+    return invertMatrix(matrix,inverse,precision);
+  }
+
+  size_t findMatrixBlocks(const Matrix& matrix, std::vector<std::vector<size_t> >& rows, std::vector<std::vector<size_t> >& cols){
+    // find the independent blocks of a matrix, i.e. the connected components
+    // of the bipartite graph of rows and columns linked by nonzero entries
+    const size_t n = size(matrix);
+    std::vector<size_t> parent(2*n);
+    for(size_t i=0; i<2*n; ++i) parent[i] = i;
+    auto findRoot = [&parent](size_t i){
+      while(parent[i] != i){
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+      }
+      return i;
+    };
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        if(static_cast<double>(matrix(i,j)) == 0.) continue;
+        const size_t a = findRoot(i);
+        const size_t b = findRoot(n+j);
+        if(a != b) parent[a] = b;
+      }
+    }
+    std::map<size_t,size_t> blocks;
+    rows.clear();
+    cols.clear();
+    for(size_t i=0; i<2*n; ++i){
+      const size_t root = findRoot(i);
+      auto it = blocks.find(root);
+      if(it == blocks.end()){
+        it = blocks.insert(std::make_pair(root,rows.size())).first;
+        rows.push_back(std::vector<size_t>());
+        cols.push_back(std::vector<size_t>());
+      }
+      if(i < n) rows[it->second].push_back(i);
+      else cols[it->second].push_back(i-n);
+    }
+    return rows.size();
+  }
+
+  double invertMatrixBlocks(const Matrix& matrix, Matrix& inverse, RooLagrangianMorphing::Precision precision){
+    // invert the independent blocks of a matrix separately, which is much
+    // cheaper than inverting the full matrix for models with many
+    // non-interfering contributions, returning the largest block condition
+    std::vector<std::vector<size_t> > rows, cols;
+    const size_t nblocks = findMatrixBlocks(matrix,rows,cols);
+    bool square = true;
+    for(size_t b=0; b<nblocks; ++b){
+      if(rows[b].size() != cols[b].size()) square = false;
+    }
+    // a non-square block means the matrix is singular, the full inversion
+    // takes care of reporting this
+    if(nblocks < 2 || !square) return invertMatrixSingle(matrix,inverse,precision);
+    DEBUG("inverting " << nblocks << " independent blocks");
+    const size_t n = size(matrix);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        inverse(i,j) = 0.;
+      }
+    }
+    double condition = 0.;
+    for(size_t b=0; b<nblocks; ++b){
+      const size_t k = rows[b].size();
+      Matrix block(diagMatrix(k));
+      Matrix blockInverse(diagMatrix(k));
+      for(size_t i=0; i<k; ++i){
+        for(size_t j=0; j<k; ++j){
+          block(i,j) = matrix(rows[b][i],cols[b][j]);
+        }
+      }
+      condition = std::max(condition,invertMatrixSingle(block,blockInverse,precision));
+      // the block maps its rows onto its columns, the inverse does the opposite
+      for(size_t i=0; i<k; ++i){
+        for(size_t j=0; j<k; ++j){
+          inverse(cols[b][i],rows[b][j]) = blockInverse(i,j);
+        }
+      }
+    }
+    return condition;
+  }
+
+  double pseudoInvertMatrix(const Matrix& matrix, Matrix& inverse, const std::vector<double>& variances, RooLagrangianMorphing::Precision precision){
+    // calculate the weighted least-squares pseudo-inverse P = (M^T V^-1 M)^-1 M^T V^-1
+    // of a matrix with more rows (samples) than columns (polynomials), such
+    // that P*M is unity and the weights w = P^T f minimize sum_s w_s^2 V_s
+    // this is done via a singular value decomposition of V^-1/2 M C, where C
+    // is a column equilibration, returning the condition of the decomposed matrix
+    // in any precision beyond double, the decomposition only checks the rank,
+    // and the pseudo-inverse is obtained from a QR decomposition in that precision
+    const size_t nrows = size(matrix);
+    const size_t ncolumns = ncols(matrix);
+    // statistical weights, falling back to unit weights if not all variances are known
+    std::vector<double> rowScale(nrows,1.);
+    bool useVariances = (variances.size() == nrows);
+    for(size_t i=0; i<variances.size(); ++i){
+      if(!(variances[i] > 0.)) useVariances = false;
+    }
+    if(useVariances){
+      for(size_t i=0; i<nrows; ++i) rowScale[i] = 1./sqrt(variances[i]);
+    } else {
+      DEBUG("sample variances unavailable, using unit weights");
+    }
+    TMatrixD a(nrows,ncolumns);
+    for(size_t i=0; i<nrows; ++i){
+      for(size_t j=0; j<ncolumns; ++j){
+        a(i,j) = rowScale[i] * static_cast<double>(matrix(i,j));
+      }
+    }
+    std::vector<double> colScale(ncolumns,1.);
+    if(RooLagrangianMorphing::gEquilibrate){
+      for(size_t j=0; j<ncolumns; ++j){
+        double largest = 0.;
+        for(size_t i=0; i<nrows; ++i) largest = std::max(largest,std::fabs(a(i,j)));
+        if(largest > 0.) colScale[j] = powerOfTwoBelow(1./largest);
+        for(size_t i=0; i<nrows; ++i) a(i,j) *= colScale[j];
+      }
+    }
+    TDecompSVD svd(a);
+    if(!svd.Decompose()){
+      ERROR("Error: singular value decomposition of the morphing matrix failed!");
+      return 0.;
+    }
+    // singular values are sorted in decreasing order
+    const TMatrixD& u = svd.GetU();
+    const TMatrixD& v = svd.GetV();
+    const TVectorD& sig = svd.GetSig();
+    if(!(sig[ncolumns-1] > std::numeric_limits<double>::epsilon() * nrows * sig[0])){
+      std::cout << std::endl;
+      printMatrix(matrix);
+      ERROR("Error: matrix does not have full column rank, the samples do not constrain all polynomials!");
+      return 0.;
+    }
+    if(resolvePrecision(precision) != RooLagrangianMorphing::DoublePrecision){
+      // the column scales are powers of two, so only the row scales are applied in the wide type
+      std::vector<double> flat(nrows*ncolumns);
+      for(size_t i=0; i<nrows; ++i){
+        for(size_t j=0; j<ncolumns; ++j) flat[i*ncolumns+j] = static_cast<double>(matrix(i,j)) * colScale[j];
+      }
+      std::vector<RooLagrangianMorphing::SuperFloat> result;
+      if(!pseudoInvertMatrixPrecision(flat,rowScale,nrows,ncolumns,precision,result)){
+        ERROR("Error: QR decomposition of the morphing matrix failed!");
+        return 0.;
+      }
+      for(size_t k=0; k<ncolumns; ++k){
+        for(size_t s=0; s<nrows; ++s){
+          inverse(k,s) = result[k*nrows+s] * RooLagrangianMorphing::SuperFloat(colScale[k]);
+        }
+      }
+      return sig[0]/sig[ncolumns-1];
+    }
+    for(size_t k=0; k<ncolumns; ++k){
+      for(size_t s=0; s<nrows; ++s){
+        double sum = 0.;
+        for(size_t l=0; l<ncolumns; ++l){
+          sum += v(k,l) * u(s,l) / sig[l];
+        }
+        inverse(k,s) = colScale[k] * sum * rowScale[s];
+      }
+    }
+    return sig[0]/sig[ncolumns-1];
+  }
+
+  size_t selectRows(const std::vector<double>& matrix, size_t nrows, size_t ncolumns, std::vector<size_t>& selected){
+    // select ncolumns rows of a matrix spanning a well-conditioned basis:
+    // greedy column-pivoted QR (on the transpose) picks the row with the
+    // largest component orthogonal to the rows selected so far, then
+    // maximum-volume swaps refine the choice, returning the rank found
+    std::vector<double> a(matrix);
+    // equilibrate the columns, such that all monomials contribute alike
+    for(size_t j=0; j<ncolumns; ++j){
+      double largest = 0.;
+      for(size_t i=0; i<nrows; ++i) largest = std::max(largest,std::fabs(a[i*ncolumns+j]));
+      if(largest == 0.) continue;
+      const double scale = powerOfTwoBelow(1./largest);
+      for(size_t i=0; i<nrows; ++i) a[i*ncolumns+j] *= scale;
+    }
+    std::vector<double> residual(a);
+    std::vector<bool> used(nrows,false);
+    double largestNorm = 0.;
+    for(size_t i=0; i<nrows; ++i){
+      double norm = 0.;
+      for(size_t j=0; j<ncolumns; ++j) norm += residual[i*ncolumns+j]*residual[i*ncolumns+j];
+      largestNorm = std::max(largestNorm,norm);
+    }
+    const double tolerance = pow(1e3*std::numeric_limits<double>::epsilon()*ncolumns,2)*largestNorm;
+    selected.clear();
+    while(selected.size() < ncolumns){
+      size_t best = nrows;
+      double bestNorm = 0.;
+      for(size_t i=0; i<nrows; ++i){
+        if(used[i]) continue;
+        double norm = 0.;
+        for(size_t j=0; j<ncolumns; ++j) norm += residual[i*ncolumns+j]*residual[i*ncolumns+j];
+        if(norm > bestNorm){
+          bestNorm = norm;
+          best = i;
+        }
+      }
+      if(best == nrows || !(bestNorm > tolerance)) return selected.size();
+      used[best] = true;
+      selected.push_back(best);
+      // orthogonalize the remaining rows against the new direction
+      const double norm = sqrt(bestNorm);
+      std::vector<double> q(ncolumns);
+      for(size_t j=0; j<ncolumns; ++j) q[j] = residual[best*ncolumns+j]/norm;
+      for(size_t i=0; i<nrows; ++i){
+        if(used[i]) continue;
+        double proj = 0.;
+        for(size_t j=0; j<ncolumns; ++j) proj += residual[i*ncolumns+j]*q[j];
+        for(size_t j=0; j<ncolumns; ++j) residual[i*ncolumns+j] -= proj*q[j];
+      }
+    }
+    // maximum-volume refinement: express every row in the basis of the
+    // selected ones, a coefficient c > 1 means swapping the two rows
+    // increases the volume spanned by the selection by a factor c
+    for(int iteration=0; iteration<100; ++iteration){
+      std::vector<double> basis(ncolumns*ncolumns);
+      for(size_t k=0; k<ncolumns; ++k){
+        for(size_t j=0; j<ncolumns; ++j) basis[k*ncolumns+j] = a[selected[k]*ncolumns+j];
+      }
+      std::vector<double> inverse;
+      if(!invertMatrixT<double>(basis,ncolumns,inverse)) break;
+      size_t swapRow = nrows;
+      size_t swapBasis = 0;
+      double largest = 1.01;
+      for(size_t i=0; i<nrows; ++i){
+        if(used[i]) continue;
+        for(size_t k=0; k<ncolumns; ++k){
+          double c = 0.;
+          for(size_t j=0; j<ncolumns; ++j) c += a[i*ncolumns+j]*inverse[j*ncolumns+k];
+          if(std::fabs(c) > largest){
+            largest = std::fabs(c);
+            swapRow = i;
+            swapBasis = k;
+          }
+        }
+      }
+      if(swapRow == nrows) break;
+      used[selected[swapBasis]] = false;
+      used[swapRow] = true;
+      selected[swapBasis] = swapRow;
+    }
+    return ncolumns;
+  }
+
+  bool invertMatrixPrecisionEquilibrated(const std::vector<double>& matrix, size_t n, RooLagrangianMorphing::Precision precision, std::vector<WideFloat>& inverse){
+    // invert a flat matrix in the given precision, equilibrating it if requested
+    if(!RooLagrangianMorphing::gEquilibrate) return invertMatrixPrecision(matrix,n,precision,inverse);
+    std::vector<double> rowScale, colScale;
+    computeEquilibration(matrix,n,rowScale,colScale);
+    std::vector<double> scaled(matrix);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        scaled[i*n+j] *= rowScale[i]*colScale[j];
+      }
+    }
+    if(!invertMatrixPrecision(scaled,n,precision,inverse)) return false;
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        // powers of two, so the scaling is exact
+        inverse[i*n+j] = WideFloat(inverse[i*n+j] * WideFloat(colScale[i]*rowScale[j]));
+      }
+    }
+    return true;
+  }
+}
+
 namespace {
   struct HistFuncAccessor : protected RooHistFunc	{
     static RooAbsCollection* getObservables(RooHistFunc *hf){
@@ -251,27 +943,182 @@ namespace {
       return &((ParamHistFuncAccessor*)hf)->_p;
     }
   };
+
+  //_____________________________________________________________________________
+
+  std::vector<const TAxis*> getHistogramAxes(const TObject* obj){
+    // retrieve the axes of a TH1, TH2, TH3 or THn
+    std::vector<const TAxis*> axes;
+    const TH1* hist = dynamic_cast<const TH1*>(obj);
+    if(hist){
+      axes.push_back(hist->GetXaxis());
+      if(hist->GetDimension() > 1) axes.push_back(hist->GetYaxis());
+      if(hist->GetDimension() > 2) axes.push_back(hist->GetZaxis());
+      return axes;
+    }
+    const THnBase* hn = dynamic_cast<const THnBase*>(obj);
+    if(hn){
+      for(Int_t i=0; i<hn->GetNdimensions(); ++i){
+        axes.push_back(hn->GetAxis(i));
+      }
+    }
+    return axes;
+  }
+
+  //_____________________________________________________________________________
+
+  void getHistogramContents(const TObject* obj, std::vector<double>& contents, std::vector<double>& errors){
+    // retrieve the bin contents and errors of a TH1, TH2, TH3 or THn without
+    // under- and overflow, in the flat bin ordering of a RooDataHist where
+    // the first axis runs slowest
+    const std::vector<const TAxis*> axes(getHistogramAxes(obj));
+    const size_t ndim = axes.size();
+    size_t nbins = ndim > 0 ? 1 : 0;
+    for(auto axis:axes){
+      nbins *= axis->GetNbins();
+    }
+    contents.assign(nbins,0.);
+    errors.assign(nbins,0.);
+    const TH1* hist = dynamic_cast<const TH1*>(obj);
+    const THnBase* hn = dynamic_cast<const THnBase*>(obj);
+    std::vector<Int_t> idx(std::max(ndim,size_t(3)),0);
+    for(size_t i=0; i<nbins; ++i){
+      size_t rest = i;
+      for(size_t d=ndim; d>0; --d){
+        const size_t n = axes[d-1]->GetNbins();
+        idx[d-1] = rest % n + 1;
+        rest /= n;
+      }
+      if(hist){
+        const Int_t bin = hist->GetBin(idx[0],idx[1],idx[2]);
+        contents[i] = hist->GetBinContent(bin);
+        errors[i] = hist->GetBinError(bin);
+      } else {
+        // sparse histograms return a negative index for unfilled bins
+        const Long64_t bin = hn->GetBin(&(idx[0]));
+        if(bin < 0) continue;
+        contents[i] = hn->GetBinContent(bin);
+        errors[i] = hn->GetBinError(bin);
+      }
+    }
+  }
+
+  //_____________________________________________________________________________
+
+  void setObservableBinning(RooRealVar* var, const TAxis* axis){
+    // copy the (possibly variable) binning of a histogram axis to an observable
+    const int n = axis->GetNbins();
+    std::vector<double> bins;
+    for(int i =1 ; i < n+1 ; ++i){
+      bins.push_back(axis->GetBinLowEdge(i));
+    }
+    bins.push_back(axis->GetBinUpEdge(n));
+    var->setBinning(RooBinning(n,&(bins[0])));
+  }
+
+  //_____________________________________________________________________________
+
+  std::vector<std::string> makeObservableNames(const char* obsname, size_t ndim){
+    // name the observables of a multi-dimensional input, either from a
+    // comma-separated list or by numbering the additional axes
+    std::vector<std::string> names;
+    std::stringstream ss(obsname);
+    std::string name;
+    while(std::getline(ss,name,',')){
+      names.push_back(name);
+    }
+    if(names.size() == ndim) return names;
+    if(names.size() > 1){
+      ERROR("number of observable names in '" << obsname << "' does not match the " << ndim << " axes of the input!");
+    }
+    names.clear();
+    names.push_back(obsname);
+    for(size_t i=1; i<ndim; ++i){
+      names.push_back(TString::Format("%s_%d",obsname,(int)i).Data());
+    }
+    return names;
+  }
+
+  //_____________________________________________________________________________
+
+  TH1* makeEmptyHistogram(const char* name, const RooArgList& observables){
+    // create an empty histogram with the binning of the observables
+    // inputs with more than three observables are unrolled into one axis
+    std::vector<RooRealVar*> vars;
+    for(int i=0; i<observables.getSize(); ++i){
+      vars.push_back(static_cast<RooRealVar*>(observables.at(i)));
+    }
+    switch(vars.size()){
+    case 1:
+      return new TH1F(name,name,vars[0]->getBins(),vars[0]->getBinning().array());
+    case 2:
+      return new TH2F(name,name,vars[0]->getBins(),vars[0]->getBinning().array(),vars[1]->getBins(),vars[1]->getBinning().array());
+    case 3:
+      return new TH3F(name,name,vars[0]->getBins(),vars[0]->getBinning().array(),vars[1]->getBins(),vars[1]->getBinning().array(),vars[2]->getBins(),vars[2]->getBinning().array());
+    default:
+      int nbins = 1;
+      for(auto var:vars){
+        nbins *= var->getBins();
+      }
+      return new TH1F(name,name,nbins,0,nbins);
+    }
+  }
+
+  //_____________________________________________________________________________
+
+  Int_t getGlobalBin(const TH1* hist, const RooArgList& observables, size_t i){
+    // translate a flat RooDataHist index into the global bin of a histogram
+    // created with makeEmptyHistogram
+    const int ndim = observables.getSize();
+    if(ndim > 3) return i+1;
+    Int_t idx[3] = {0,0,0};
+    for(int d=ndim; d>0; --d){
+      const int n = static_cast<RooRealVar*>(observables.at(d-1))->getBins();
+      idx[d-1] = i % n + 1;
+      i /= n;
+    }
+    return hist->GetBin(idx[0],idx[1],idx[2]);
+  }
 }
 	
 RooDataHist* RooLagrangianMorphing::makeDataHistogram(TH1* hist, RooRealVar* observable, const char* histname){
   // convert a TH1 into a RooDataHist
   if(!observable) throw std::runtime_error("invalid observable passed!");
+  return RooLagrangianMorphing::makeDataHistogram(hist,RooArgList(*observable),histname);
+}
+
+RooDataHist* RooLagrangianMorphing::makeDataHistogram(TObject* hist, const RooArgList& observables, const char* histname){
+  // convert a TH1, TH2, TH3 or THn into a RooDataHist, with one observable per axis
+  if(observables.getSize() < 1) throw std::runtime_error("invalid observables passed!");
   TString name(histname ? histname : hist->GetName());
-  RooArgSet args;
-  args.add(*observable);
+  RooArgSet args(observables);
   RooDataHist* dh = new RooDataHist(name,name,args);
-  RooLagrangianMorphing::setDataHistogram(hist,observable,dh);
+  RooLagrangianMorphing::setDataHistogram(hist,dh);
   return dh;
 }
 
 void RooLagrangianMorphing::setDataHistogram(TH1* hist, RooRealVar* observable, RooDataHist* dh){
   // set the values of a RooDataHist to those of a TH1
-  int nrBins = observable->getBins();
-  for (int i=0;i<nrBins;i++) {
-    observable->setBin(i);
-    dh->set(*observable,hist->GetBinContent(i+1),hist->GetBinError(i+1));
+  UNUSED(observable);
+  RooLagrangianMorphing::setDataHistogram((TObject*)hist,dh);
+}
+
+void RooLagrangianMorphing::setDataHistogram(TObject* hist, RooDataHist* dh){
+  // set the values of a RooDataHist to those of a TH1, TH2, TH3 or THn
+  // the bins are addressed by their flat index, which avoids positioning
+  // every observable separately
+  std::vector<double> contents;
+  std::vector<double> errors;
+  getHistogramContents(hist,contents,errors);
+  const Int_t nrBins = dh->numEntries();
+  if(size_t(nrBins) != contents.size()){
+    ERROR("histogram '" << hist->GetName() << "' has " << contents.size() << " bins, expected " << nrBins << "!");
+    return;
+  }
+  for (Int_t i=0;i<nrBins;i++) {
     dh->get(i);
-    DEBUG("dh = " << dh->weight() << " +/- " << sqrt(dh->weightSquared()) << ", hist=" <<  hist->GetBinContent(i+1) << " +/- " << hist->GetBinError(i+1));
+    dh->set(contents[i],errors[i]);
+    DEBUG("dh = " << dh->weight() << " +/- " << sqrt(dh->weightSquared()) << ", hist=" <<  contents[i] << " +/- " << errors[i]);
   }
 }
 
@@ -393,10 +1240,11 @@ namespace {
         line.clear();
       }
     }
-    MatrixT retval(matrix.size(),matrix.size());
+    const size_t ncolumns = matrix.empty() ? 0 : matrix[0].size();
+    MatrixT retval(matrix.size(),ncolumns);
     for(size_t i=0; i<matrix.size(); ++i){
-      if(matrix[i].size() != matrix.size()){
-        ERROR("matrix read from stream doesn't seem to be square!");
+      if(matrix[i].size() != ncolumns){
+        ERROR("matrix read from stream doesn't seem to be rectangular!");
       }
       for(size_t j=0; j<matrix[i].size(); ++j){
         assignElement(retval(i,j),matrix[i][j]);
@@ -757,8 +1605,9 @@ namespace {
 
   //_____________________________________________________________________________
 
-  void collectHistograms(const char* name,TDirectory* file, std::map<std::string,int>& list_hf, RooArgList& physics, RooRealVar& var, const std::string& varname, const std::string& /*basefolder*/, const RooLagrangianMorphing::ParamMap& inputParameters) {
+  void collectHistograms(const char* name,TDirectory* file, std::map<std::string,int>& list_hf, RooArgList& physics, const RooArgList& observables, const std::string& varname, const std::string& /*basefolder*/, const RooLagrangianMorphing::ParamMap& inputParameters) {
     // collect the histograms from the input file and convert them to RooFit objects
+    // TH2, TH3 and THn inputs are stored with one observable per axis
     DEBUG("building list of histogram functions");
     bool binningOK = false;
     for(auto sampleit=inputParameters.begin(); sampleit!=inputParameters.end(); ++sampleit){
@@ -768,8 +1617,8 @@ namespace {
         ERROR("Error: unable to access data from folder '" << sample << "'!");
         continue;
       }
-      TH1* hist = dynamic_cast<TH1*>(findObject(folder,varname));
-      if(!hist){
+      TObject* hist = findObject(folder,varname);
+      if(!hist || !(hist->InheritsFrom(TH1::Class()) || hist->InheritsFrom(THnBase::Class()))){
         std::stringstream errstr;
         errstr << "Error: unable to retrieve histogram '" << varname << "' from folder '" << sample << "'. contents are:";
         TIter next(folder->GetListOfFolders()->begin());
@@ -778,6 +1627,7 @@ namespace {
           errstr << " " << f->GetName();
         }
         ERROR(errstr.str());
+        continue;
       }
       
       auto it = list_hf.find(sample);
@@ -785,30 +1635,31 @@ namespace {
         RooHistFunc* hf = (RooHistFunc*)(physics.at(it->second));
         hf->setValueDirty(); 
         RooDataHist* dh = &(hf->dataHist());
-        RooLagrangianMorphing::setDataHistogram(hist,&var,dh);
+        RooLagrangianMorphing::setDataHistogram(hist,dh);
       } else {
         if(!binningOK){
-          int n = hist->GetNbinsX();
-          std::vector<double> bins;
-          for(int i =1 ; i < n+1 ; ++i){
-            bins.push_back(hist->GetBinLowEdge(i));
+          const std::vector<const TAxis*> axes(getHistogramAxes(hist));
+          if(axes.size() != size_t(observables.getSize())){
+            ERROR("histogram '" << hist->GetName() << "' has " << axes.size() << " axes, expected " << observables.getSize() << "!");
           }
-          bins.push_back(hist->GetBinLowEdge(n)+hist->GetBinWidth(n));
-          var.setBinning(RooBinning(n,&(bins[0])));
+          for(size_t i=0; i<axes.size() && i<size_t(observables.getSize()); ++i){
+            setObservableBinning(static_cast<RooRealVar*>(observables.at(i)),axes[i]);
+          }
+          binningOK = true;
         }
         
         // generate the mean value
         TString histname = makeValidName(TString::Format("dh_%s_%s",sample.c_str(),name));
         TString funcname = makeValidName(TString::Format("phys_%s_%s",sample.c_str(),name));        
-        RooDataHist* dh = RooLagrangianMorphing::makeDataHistogram(hist,&var,histname);
+        RooDataHist* dh = RooLagrangianMorphing::makeDataHistogram(hist,observables,histname);
         // add it to the list
-        RooHistFunc* hf = new RooHistFunc(funcname,funcname,var,*dh);
+        RooHistFunc* hf = new RooHistFunc(funcname,funcname,RooArgSet(observables),*dh);
         int idx = physics.getSize();
         list_hf[sample] = idx;
         physics.add(*hf);
         assert(hf = (RooHistFunc*)physics.at(idx));
       }
-      DEBUG("found histogram " << hist->GetName() << " with integral " << hist->Integral());
+      DEBUG("found histogram " << hist->GetName());
     }
   }
 
@@ -992,9 +1843,8 @@ namespace {
 
   template<class MatrixT, class T1, class T2>
   inline MatrixT buildMatrixT(const RooLagrangianMorphing::ParamMap& inputParameters, const FormulaList& formulas, const T1& args, const RooLagrangianMorphing::FlagMap& flagValues, const T2& flags){
-    // fill the matrix of coefficients
-    const size_t dim = inputParameters.size();
-    MatrixT matrix(dim,dim);
+    // fill the matrix of coefficients, one row per sample and one column per formula
+    MatrixT matrix(inputParameters.size(),formulas.size());
     int row = 0;
     for(auto sampleit=inputParameters.begin(); sampleit!=inputParameters.end(); ++sampleit){
       const std::string sample(sampleit->first);
@@ -1022,8 +1872,9 @@ namespace {
   }
 
   inline void checkMatrix(const RooLagrangianMorphing::ParamMap& inputParameters, const FormulaList& formulas){
-    // check if the matrix is square
-    if(inputParameters.size() != formulas.size()){
+    // check if the matrix is square, or overdetermined if least-squares morphing is enabled
+    const bool overdetermined = RooLagrangianMorphing::gLeastSquares && inputParameters.size() > formulas.size();
+    if(inputParameters.size() != formulas.size() && !overdetermined){
       std::stringstream ss;
       ss << "ERROR: matrix is not square, consistency check failed: " <<
         inputParameters.size() << " samples, " <<
@@ -1199,12 +2050,15 @@ namespace {
   }
   
   template<class T>
-  inline FormulaList createFormulas(const char* name,const RooLagrangianMorphing::ParamMap& inputs, const std::vector<T*>& vertices, RooArgList& couplings, const T& flags, const std::vector<T*>& nonInterfering){
+  inline FormulaList createFormulas(const char* name,const RooLagrangianMorphing::ParamMap& inputs, const std::vector<T*>& vertices, RooArgList& couplings, const T& flags, const std::vector<T*>& nonInterfering, MorphFuncPattern& morphfuncpattern){
     // create the weight formulas required for the morphing
-    DEBUG("building vertex map");
-    VertexMap vertexmap(buildVertexMap<T>(vertices,couplings));
-    DEBUG("calculating pattern for vertexmap of size " << vertexmap.size());
-    MorphFuncPattern morphfuncpattern(calculateFunction(vertexmap));
+    // the pattern is only calculated if an empty one is given
+    if(morphfuncpattern.empty()){
+      DEBUG("building vertex map");
+      VertexMap vertexmap(buildVertexMap<T>(vertices,couplings));
+      DEBUG("calculating pattern for vertexmap of size " << vertexmap.size());
+      morphfuncpattern = calculateFunction(vertexmap);
+    }
     DEBUG("building formulas");
     FormulaList retval = buildFormulas(name,inputs,morphfuncpattern,couplings,flags,nonInterfering);
     if(retval.size() == 0){
@@ -1214,6 +2068,77 @@ namespace {
     checkMatrix(inputs,retval);
     return retval;
   }
+
+  template<class T>
+  inline FormulaList createFormulas(const char* name,const RooLagrangianMorphing::ParamMap& inputs, const std::vector<T*>& vertices, RooArgList& couplings, const T& flags, const std::vector<T*>& nonInterfering){
+    // create the weight formulas required for the morphing
+    MorphFuncPattern morphfuncpattern;
+    return createFormulas(name,inputs,vertices,couplings,flags,nonInterfering,morphfuncpattern);
+  }
+
+  inline double couplingDerivative(RooAbsReal* coupling, RooRealVar* param, double epsilon){
+    // differentiate a single coupling with respect to a parameter
+    // couplings that are the parameter itself or do not depend on it are trivial,
+    // composite couplings (formulas of the operators) are differentiated
+    // numerically, with the variation clipped to the range of the parameter
+    if(coupling == param) return 1.;
+    if(!coupling->dependsOn(*param)) return 0.;
+    const double val = param->getVal();
+    const double h = epsilon * std::max(1.,fabs(val));
+    const double up = std::min(val+h,param->getMax());
+    const double dn = std::max(val-h,param->getMin());
+    if(!(up > dn)) return 0.;
+    param->setVal(up);
+    const double vup = coupling->getVal();
+    param->setVal(dn);
+    const double vdn = coupling->getVal();
+    param->setVal(val);
+    return (vup-vdn)/(up-dn);
+  }
+
+  inline double formulaDerivative(RooAbsReal* formula, RooRealVar* param, double epsilon, std::map<RooAbsReal*,double>& derivatives){
+    // differentiate a morphing polynomial analytically with respect to a parameter
+    // every polynomial is a product of couplings g_u with multiplicities n_u, such that
+    // d/dp prod_u g_u^n_u = sum_u n_u g_u^(n_u-1) dg_u/dp prod_{w!=u} g_w^n_w
+    // the derivatives of the couplings are shared among the polynomials
+    RooProduct* prod = dynamic_cast<RooProduct*>(formula);
+    if(!prod){
+      return couplingDerivative(formula,param,epsilon);
+    }
+    std::vector<std::pair<RooAbsReal*,int> > factors;
+    const RooArgList components(prod->components());
+    RooFIter itr(components.fwdIterator());
+    RooAbsArg* obj;
+    while((obj = itr.next())){
+      RooAbsReal* factor = static_cast<RooAbsReal*>(obj);
+      bool found = false;
+      for(auto& f:factors){
+        if(f.first == factor){
+          ++f.second;
+          found = true;
+          break;
+        }
+      }
+      if(!found) factors.push_back(std::make_pair(factor,1));
+    }
+    double derivative = 0.;
+    for(size_t u=0; u<factors.size(); ++u){
+      RooAbsReal* factor = factors[u].first;
+      auto known = derivatives.find(factor);
+      if(known == derivatives.end()){
+        known = derivatives.insert(std::make_pair(factor,couplingDerivative(factor,param,epsilon))).first;
+      }
+      if(known->second == 0.) continue;
+      const int n = factors[u].second;
+      double term = n * std::pow(factor->getVal(),n-1) * known->second;
+      for(size_t w=0; w<factors.size(); ++w){
+        if(w == u) continue;
+        term *= std::pow(factors[w].first->getVal(),factors[w].second);
+      }
+      derivative += term;
+    }
+    return derivative;
+  }
 }
 
 
@@ -1239,7 +2164,8 @@ namespace {
       }
       int formulaidx = 0;
       // build the formula with the correct normalization
-#ifdef USE_UBLAS
+      // the coefficients are stored in the weight itself rather than in one
+      // constant per matrix element, which keeps the graph compact
       RooLagrangianMorphing::LinearCombination* sampleformula = new RooLagrangianMorphing::LinearCombination(name_full.Data());
       for(auto formulait=formulas.begin(); formulait!=formulas.end(); ++formulait){
         const RooLagrangianMorphing::SuperFloat val(inverse(formulaidx,sampleidx));
@@ -1247,19 +2173,6 @@ namespace {
         sampleformula->add(val,formula);
         formulaidx++;
       }
-#else
-      RooArgList numbers;
-      RooArgList formulalist;
-      for(auto formulait=formulas.begin(); formulait!=formulas.end(); ++formulait){
-        TString idx = TString::Format("c_%d_%d",(int)sampleidx,(int)formulaidx);
-        RooConstVar* constVal = new RooConstVar(idx,idx,inverse(formulaidx,sampleidx));
-        RooAbsReal* formula = formulait->second;
-        numbers.add(*constVal);
-        formulalist.add(*formula);
-        formulaidx++;        
-      }
-      RooRealSumFunc* sampleformula = new RooRealSumFunc(name_full.Data(),name_full.Data(),numbers,formulalist);
-#endif
       weights.add(*sampleformula);      
       sampleidx++;
     }
@@ -1422,6 +2335,188 @@ RooArgSet RooLagrangianMorphing::makeSMEFTHyyCouplings(RooAbsCollection& operato
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+// instrumentation ////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+namespace {
+  RooLagrangianMorphing::Statistics gGlobalStatistics;
+
+  inline void countEvent(RooLagrangianMorphing::Statistics* statistics, unsigned long long RooLagrangianMorphing::Statistics::* counter){
+    // increment a counter of an object (if any) and of the process
+    if(statistics) ++(statistics->*counter);
+    ++(gGlobalStatistics.*counter);
+  }
+
+  class PhaseTimer {
+    // wall-clock timer of one phase, booked to an object (if any) and to the process
+    // the phase ends when the timer is stopped or goes out of scope
+    RooLagrangianMorphing::Statistics* _statistics;
+    RooLagrangianMorphing::Phase _phase;
+    std::chrono::steady_clock::time_point _start;
+    double _elapsed = -1.;
+  public:
+    PhaseTimer(RooLagrangianMorphing::Statistics* statistics, RooLagrangianMorphing::Phase phase) :
+      _statistics(statistics), _phase(phase), _start(std::chrono::steady_clock::now())
+    {}
+    ~PhaseTimer(){
+      this->stop();
+    }
+    double stop(){
+      if(this->_elapsed >= 0) return this->_elapsed;
+      this->_elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-this->_start).count();
+      if(this->_statistics){
+        this->_statistics->phaseTime[this->_phase] += this->_elapsed;
+        ++this->_statistics->phaseCalls[this->_phase];
+      }
+      gGlobalStatistics.phaseTime[this->_phase] += this->_elapsed;
+      ++gGlobalStatistics.phaseCalls[this->_phase];
+      return this->_elapsed;
+    }
+  };
+
+  //_____________________________________________________________________________
+
+  typedef std::function<void(RooLagrangianMorphing::MemoryReport&,std::set<const void*>&)> MemoryReporter;
+
+  std::mutex& memoryRegistryMutex(){
+    // guard for the registry of live morphing objects
+    // allocated once and never freed, as objects owned by ROOT are only
+    // destroyed during its teardown, after function-local statics may be gone
+    static std::mutex* mutex = new std::mutex();
+    return *mutex;
+  }
+
+  std::map<const void*,MemoryReporter>& memoryRegistry(){
+    // registry of all live morphing objects, used for the process-level memory report
+    // never freed for the same reason as its mutex
+    static std::map<const void*,MemoryReporter>* registry = new std::map<const void*,MemoryReporter>();
+    return *registry;
+  }
+
+  void registerInstance(const void* obj, const MemoryReporter& reporter){
+    std::lock_guard<std::mutex> lock(memoryRegistryMutex());
+    memoryRegistry()[obj] = reporter;
+  }
+
+  void unregisterInstance(const void* obj){
+    std::lock_guard<std::mutex> lock(memoryRegistryMutex());
+    memoryRegistry().erase(obj);
+  }
+
+  inline void addMemory(RooLagrangianMorphing::MemoryReport& report, RooLagrangianMorphing::MemoryCategory category, unsigned long long bytes){
+    // book one object to a category
+    report.bytes[category] += bytes;
+    ++report.objects[category];
+  }
+
+  void addNodeMemory(RooAbsArg* node, RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen){
+    // book a RooFit node to its category, nodes shared between objects are only counted once
+    // the sizes are estimates, the heap memory of the proxies of a node is not included
+    if(!node || !seen.insert(node).second) return;
+    RooHistFunc* hf = dynamic_cast<RooHistFunc*>(node);
+    if(hf){
+      addMemory(report,RooLagrangianMorphing::OtherNodeMemory,sizeof(RooHistFunc));
+      const RooDataHist* dh = &(hf->dataHist());
+      if(seen.insert(dh).second){
+        // weights, lower and upper errors, sum of squared weights and bin volumes
+        addMemory(report,RooLagrangianMorphing::TemplateMemory,sizeof(RooDataHist) + dh->numEntries()*5*sizeof(double));
+      }
+    } else if(dynamic_cast<const RooLagrangianMorphing::LinearCombination*>(node)){
+      addMemory(report,RooLagrangianMorphing::LinearCombinationMemory,static_cast<const RooLagrangianMorphing::LinearCombination*>(node)->getMemorySize());
+    } else if(dynamic_cast<const RooProduct*>(node)){
+      addMemory(report,RooLagrangianMorphing::ProductMemory,node->IsA()->Size());
+    } else if(dynamic_cast<const RooConstVar*>(node)){
+      addMemory(report,RooLagrangianMorphing::ConstVarMemory,node->IsA()->Size());
+    } else {
+      addMemory(report,RooLagrangianMorphing::OtherNodeMemory,node->IsA()->Size());
+    }
+  }
+
+  template<class MatrixT>
+  inline unsigned long long matrixMemory(const MatrixT& matrix){
+    // estimate the memory held by a matrix
+#ifdef USE_UBLAS
+    const size_t element = sizeof(RooLagrangianMorphing::SuperFloat);
+#else
+    const size_t element = sizeof(double);
+#endif
+    return sizeof(MatrixT) + size(matrix)*ncols(matrix)*element;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// shared weight engine ///////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+class RooLagrangianMorphing::WeightEngine {
+public:
+  // formulas, morphing matrix and sample weights, which only depend on the
+  // param cards and the vertices, and can hence be shared between all
+  // morphing functions built from the same samples
+  RooArgList _couplings;
+  FormulaList _formulas;
+  RooArgList _weights;
+  Matrix _matrix;
+  Matrix _inverse;
+  double _condition = NaN;
+  double _buildTime = 0.;
+  double _inversionTime = 0.;
+  RooLagrangianMorphing::ParamMap _paramCards;
+  RooLagrangianMorphing::FlagMap _flagValues;
+
+  WeightEngine(){ };
+  ~WeightEngine(){
+    // the engine owns the weights and the formulas they are built from
+    RooFIter itr(this->_weights.fwdIterator());
+    RooAbsArg* obj;
+    while((obj = itr.next())){
+      delete obj;
+    }
+    for(auto it:this->_formulas){
+      delete it.second;
+    }
+  }
+
+  //_____________________________________________________________________________
+
+  bool isCompatible(const RooLagrangianMorphing::ParamMap& paramCards, const RooLagrangianMorphing::FlagMap& flagValues, const RooArgList& couplings) const {
+    // check if a morphing function with the given inputs can use this engine
+    // the couplings need to be the very same objects, not only of the same name
+    if(paramCards != this->_paramCards) return false;
+    if(flagValues != this->_flagValues) return false;
+    if(couplings.getSize() != this->_couplings.getSize()) return false;
+    for(int i=0; i<couplings.getSize(); ++i){
+      if(couplings.at(i) != this->_couplings.at(i)) return false;
+    }
+    return true;
+  }
+};
+
+namespace {
+  struct TemplateTable {
+    // bin contents of the template histograms, one entry per sample
+    std::vector<std::vector<double> > contents;
+    std::vector<std::vector<double> > sumw2;
+    std::vector<std::vector<double> > errors;
+    std::vector<double> totals;
+    std::vector<double> totalSumW2;
+  };
+}
+
+class RooLagrangianMorphing::SharedCache {
+public:
+  // the expensive, immutable parts of the cache of a morphing function,
+  // shared by reference counting between the function and all its clones
+  MorphFuncPattern _pattern;
+  Matrix _matrix;
+  Matrix _inverse;
+  double _condition = NaN;
+  double _buildTime = 0.;
+  double _inversionTime = 0.;
+  std::shared_ptr<const TemplateTable> _templates;
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // CacheElem magic ////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
@@ -1441,6 +2536,21 @@ public:
   Matrix _matrix;
   Matrix _inverse;
   double _condition;
+  double _buildTime = 0.;
+  double _inversionTime = 0.;
+
+  // resolved (weight, template) table of the morphing function, one entry per sample
+  std::vector<RooAbsReal*> _componentWeights;
+  std::vector<RooAbsReal*> _componentPhysics;
+  std::shared_ptr<const TemplateTable> _templates;
+  bool _templatesValid = false;
+
+  // shared engine providing couplings, formulas, matrices and weights, if any
+  std::shared_ptr<RooLagrangianMorphing::WeightEngine> _engine;
+  // immutable parts shared with the clones of the function
+  std::shared_ptr<RooLagrangianMorphing::SharedCache> _shared;
+  // statistics of the owning function, if any
+  RooLagrangianMorphing::Statistics* _statistics = NULL;
   
   CacheElem(){ };
   virtual void operModeHook(RooAbsArg::OperMode) override {};
@@ -1457,6 +2567,7 @@ public:
   virtual ~CacheElem(){
     // default destructor
     delete _sumFunc; // the sumfunc owns all its contents
+    if(_engine) return; // the formulas belong to the shared engine
     for(auto it:_formulas){
       delete it.second;
     }
@@ -1467,42 +2578,211 @@ public:
   static inline InternalType* makeSum(const char* name, const char* title, const RooArgList &funcList, const RooArgList &coefList);  
   //_____________________________________________________________________________
      
-  inline void createComponents(const RooLagrangianMorphing::ParamMap& inputParameters,const char* funcname,const std::vector<RooListProxy*>& vertices,const std::vector<RooListProxy*>& nonInterfering, const RooListProxy& flags){
+  inline void createComponents(const RooLagrangianMorphing::ParamMap& inputParameters,const char* funcname,const std::vector<RooListProxy*>& vertices,const std::vector<RooListProxy*>& nonInterfering, const RooListProxy& flags, MorphFuncPattern& pattern){
     // create the basic objects required for the morphing
+    // the pattern is calculated unless it is already known
     RooArgList operators;
     DEBUG("collecting couplings");
+    PhaseTimer components(this->_statistics,RooLagrangianMorphing::ComponentsPhase);
     for(auto vertex : vertices){
       extractCouplings(*vertex,this->_couplings);
     }
     extractOperators(this->_couplings,operators);
-    this->_formulas = ::createFormulas(funcname,inputParameters,vertices,this->_couplings,flags,nonInterfering);
+    components.stop();
+    PhaseTimer formulas(this->_statistics,RooLagrangianMorphing::FormulasPhase);
+    this->_formulas = ::createFormulas(funcname,inputParameters,vertices,this->_couplings,flags,nonInterfering,pattern);
+  }
+
+  inline void createComponents(const RooLagrangianMorphing::ParamMap& inputParameters,const char* funcname,const std::vector<RooListProxy*>& vertices,const std::vector<RooListProxy*>& nonInterfering, const RooListProxy& flags){
+    // create the basic objects required for the morphing
+    MorphFuncPattern pattern;
+    this->createComponents(inputParameters,funcname,vertices,nonInterfering,flags,pattern);
+  }
+
+  //_____________________________________________________________________________
+
+  inline void useShared(const std::shared_ptr<RooLagrangianMorphing::SharedCache>& shared){
+    // take over the matrices and templates shared with other clones
+    this->_shared = shared;
+#ifndef USE_UBLAS
+    this->_matrix.ResizeTo(shared->_matrix.GetNrows(),shared->_matrix.GetNcols());
+    this->_inverse.ResizeTo(shared->_inverse.GetNrows(),shared->_inverse.GetNcols());
+#endif
+    this->_matrix = shared->_matrix;
+    this->_inverse = shared->_inverse;
+    this->_condition = shared->_condition;
+    this->_buildTime = shared->_buildTime;
+    this->_inversionTime = shared->_inversionTime;
+    this->_templates = shared->_templates;
+    this->_templatesValid = (bool)(shared->_templates);
   }
 
   //_____________________________________________________________________________
 
   template<class List>
-  inline void buildMatrix(const RooLagrangianMorphing::ParamMap& inputParameters,const RooLagrangianMorphing::FlagMap& inputFlags,const List& flags){
+  inline void restoreMatrix(const RooLagrangianMorphing::ParamMap& inputParameters,const RooLagrangianMorphing::FlagMap& inputFlags,const List& flags, const Matrix& inverse, double condition){
+    // rebuild the morphing matrix, but take the inverse from a previous inversion
+    RooArgList operators;
+    extractOperators(this->_couplings,operators);
+    Matrix matrix(buildMatrixT<Matrix>(inputParameters,this->_formulas,operators,inputFlags,flags));
+    if(size(matrix) != ncols(inverse) || ncols(matrix) != size(inverse)){
+      ERROR("persisted inverse has dimension " << size(inverse) << "x" << ncols(inverse) << ", expected " << ncols(matrix) << "x" << size(matrix) << "!");
+    }
+#ifndef USE_UBLAS
+    this->_matrix.ResizeTo(matrix.GetNrows(),matrix.GetNcols());
+    this->_inverse.ResizeTo(inverse.GetNrows(),inverse.GetNcols());
+#endif
+    this->_matrix  = matrix;
+    this->_inverse = inverse;
+    this->_condition = condition;
+  }
+
+  //_____________________________________________________________________________
+
+  inline std::shared_ptr<RooLagrangianMorphing::SharedCache> share(const MorphFuncPattern& pattern){
+    // publish the matrices of this cache for sharing with clones
+    std::shared_ptr<RooLagrangianMorphing::SharedCache> shared(new RooLagrangianMorphing::SharedCache());
+    shared->_pattern = pattern;
+#ifndef USE_UBLAS
+    shared->_matrix.ResizeTo(this->_matrix.GetNrows(),this->_matrix.GetNcols());
+    shared->_inverse.ResizeTo(this->_inverse.GetNrows(),this->_inverse.GetNcols());
+#endif
+    shared->_matrix = this->_matrix;
+    shared->_inverse = this->_inverse;
+    shared->_condition = this->_condition;
+    shared->_buildTime = this->_buildTime;
+    shared->_inversionTime = this->_inversionTime;
+    if(this->_templatesValid) shared->_templates = this->_templates;
+    this->_shared = shared;
+    return shared;
+  }
+
+  //_____________________________________________________________________________
+
+  inline void updateTemplates(){
+    // copy the bin contents of the template histograms into the component table
+    // components that are not histograms keep empty entries
+    // a new table is created such that clones holding the old one are unaffected
+    PhaseTimer timer(this->_statistics,RooLagrangianMorphing::TemplatesPhase);
+    const size_t n = this->_componentPhysics.size();
+    std::shared_ptr<TemplateTable> table(new TemplateTable());
+    table->contents.assign(n,std::vector<double>());
+    table->sumw2.assign(n,std::vector<double>());
+    table->errors.assign(n,std::vector<double>());
+    table->totals.assign(n,0.);
+    table->totalSumW2.assign(n,0.);
+    for(size_t i=0; i<n; ++i){
+      RooHistFunc* hf = dynamic_cast<RooHistFunc*>(this->_componentPhysics[i]);
+      if(!hf) continue;
+      const RooDataHist& hist = hf->dataHist();
+      const Int_t nbins = hist.numEntries();
+      table->contents[i].resize(nbins);
+      table->sumw2[i].resize(nbins);
+      table->errors[i].resize(nbins);
+      for(Int_t j=0; j<nbins; ++j){
+        hist.get(j);
+        table->contents[i][j] = hist.weight();
+        table->sumw2[i][j] = hist.weightSquared();
+        table->errors[i][j] = sqrt(hist.weightSquared());
+        table->totals[i] += hist.weight();
+        table->totalSumW2[i] += hist.weightSquared();
+      }
+    }
+    this->_templates = table;
+    this->_templatesValid = true;
+    if(this->_shared && !this->_shared->_templates) this->_shared->_templates = table;
+  }
+
+  //_____________________________________________________________________________
+
+  inline double getSampleYield(size_t i){
+    // retrieve the total yield of a sample
+    if(!this->_templatesValid) this->updateTemplates();
+    if(!this->_templates->contents[i].empty()) return this->_templates->totals[i];
+    return this->_componentPhysics[i]->getVal();
+  }
+
+  //_____________________________________________________________________________
+
+  inline double getSampleSumW2(size_t i){
+    // retrieve the total sum of squared weights of a sample
+    if(!this->_templatesValid) this->updateTemplates();
+    if(!this->_templates->contents[i].empty()) return this->_templates->totalSumW2[i];
+    RooRealVar* rv = dynamic_cast<RooRealVar*>(this->_componentPhysics[i]);
+    if(rv) return pow(rv->getError(),2);
+    return 0.;
+  }
+
+  //_____________________________________________________________________________
+
+  inline void fillMemoryReport(RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen) const {
+    // book the memory held by this cache, objects shared with other caches
+    // (engine, clones, template table) are only counted once
+    addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_matrix));
+    addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_inverse));
+    if(this->_shared && seen.insert(this->_shared.get()).second){
+      addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_shared->_matrix));
+      addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_shared->_inverse));
+    }
+    if(this->_engine && seen.insert(this->_engine.get()).second){
+      addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_engine->_matrix));
+      addMemory(report,RooLagrangianMorphing::MatrixMemory,matrixMemory(this->_engine->_inverse));
+    }
+    if(this->_templates && seen.insert(this->_templates.get()).second){
+      const TemplateTable& t = *(this->_templates);
+      unsigned long long bytes = sizeof(TemplateTable) + (t.totals.capacity() + t.totalSumW2.capacity())*sizeof(double);
+      for(size_t i=0; i<t.contents.size(); ++i){
+        bytes += (t.contents[i].capacity() + t.sumw2[i].capacity() + t.errors[i].capacity())*sizeof(double) + 3*sizeof(std::vector<double>);
+      }
+      addMemory(report,RooLagrangianMorphing::TemplateTableMemory,bytes);
+    }
+    if(this->_sumFunc){
+      RooArgSet nodes;
+      this->_sumFunc->treeNodeServerList(&nodes);
+      RooFIter itr(nodes.fwdIterator());
+      RooAbsArg* node;
+      while((node = itr.next())){
+        addNodeMemory(node,report,seen);
+      }
+    }
+    for(const auto& formula:this->_formulas){
+      addNodeMemory(formula.second,report,seen);
+    }
+  }
+
+  //_____________________________________________________________________________
+
+  template<class List>
+  inline void buildMatrix(const RooLagrangianMorphing::ParamMap& inputParameters,const RooLagrangianMorphing::FlagMap& inputFlags,const List& flags,const std::vector<double>& variances = std::vector<double>()){
     // build and invert the morphing matrix
+    // overdetermined matrices are pseudo-inverted, weighting the samples by their variances
     RooArgList operators;
     extractOperators(this->_couplings,operators);
     DEBUG("filling matrix");
+    PhaseTimer fill(this->_statistics,RooLagrangianMorphing::MatrixFillPhase);
     Matrix matrix(buildMatrixT<Matrix>(inputParameters,this->_formulas,operators,inputFlags,flags));
+    this->_buildTime = fill.stop();
     if(size(matrix) < 1 ){
       ERROR("input matrix is empty, please provide suitable input samples!");
     }
-    Matrix inverse(diagMatrix(size(matrix)));
+    const bool square = (size(matrix) == ncols(matrix));
+    Matrix inverse(square ? diagMatrix(size(matrix)) : Matrix(ncols(matrix),size(matrix)));
 #ifdef _DEBUG_
     printMatrix(matrix);
 #endif
     DEBUG("inverting matrix");
-    double condition = (double)(invertMatrix(matrix,inverse));
+    PhaseTimer inversion(this->_statistics,RooLagrangianMorphing::InversionPhase);
+    double condition = square ? invertMatrixBlocks(matrix,inverse,RooLagrangianMorphing::gInversionPrecision) : pseudoInvertMatrix(matrix,inverse,variances,RooLagrangianMorphing::gInversionPrecision);
+    this->_inversionTime = inversion.stop();
     DEBUG("inverse matrix (condition " << condition << ") is:");
 #ifdef _DEBUG_
     printMatrix(inverse);
 #endif
     
     double unityDeviation, largestWeight;
+    PhaseTimer sanity(this->_statistics,RooLagrangianMorphing::SanityPhase);
     inverseSanity(matrix, inverse, unityDeviation, largestWeight);
+    sanity.stop();
     bool weightwarning(largestWeight > 10e7 ? true : false);
     bool unitywarning(unityDeviation > 10e-6 ? true : false);
 
@@ -1531,8 +2811,8 @@ public:
       }
     }
 #ifndef USE_UBLAS
-    this->_matrix.ResizeTo(matrix.GetNrows(),matrix.GetNrows());
-    this->_inverse.ResizeTo(matrix.GetNrows(),matrix.GetNrows());
+    this->_matrix.ResizeTo(matrix.GetNrows(),matrix.GetNcols());
+    this->_inverse.ResizeTo(inverse.GetNrows(),inverse.GetNcols());
 #endif
     this->_matrix  = matrix;
     this->_inverse = inverse;
@@ -1542,23 +2822,28 @@ public:
   //_____________________________________________________________________________
 
   inline void buildMorphingFunction(const char* name,const RooLagrangianMorphing::ParamMap& inputParameters,const std::map<std::string,int>&  storage, const RooArgList& physics,
-                                    bool allowNegativeYields,RooRealVar* observable,RooRealVar* binWidth){
+                                    bool allowNegativeYields,const RooArgList& observables,RooRealVar* binWidth){
     // build the final morphing function
     if(!binWidth){
       ERROR("invalid bin width given!");
       return;
     }
-    if(!observable){
+    if(observables.getSize() < 1){
       ERROR("invalid observable given!");
       return;
     }
     
+    PhaseTimer timer(this->_statistics,RooLagrangianMorphing::MorphingFunctionPhase);
     RooArgList operators;
     extractOperators(this->_couplings,operators);
 
     // retrieve the weights
     DEBUG("creating Sample Weights");
-    ::buildSampleWeights(this->_weights,name,inputParameters,this->_formulas,this->_inverse,this->_couplings,operators);
+    if(this->_engine){
+      this->_weights.add(this->_engine->_weights);
+    } else {
+      ::buildSampleWeights(this->_weights,name,inputParameters,this->_formulas,this->_inverse,this->_couplings,operators);
+    }
 
     DEBUG("creating RooProducts");
     // build the products of element and weight for each sample
@@ -1573,6 +2858,8 @@ public:
       if(!obj) ERROR("unable to access physics object for " << prodname);
       RooAbsReal* weight = (RooAbsReal*)(this->_weights.at(i));
       if(!weight) ERROR("unable to access weight object for " << prodname);      
+      this->_componentWeights.push_back(weight);
+      this->_componentPhysics.push_back(obj);
       prodname.Append("_");
       prodname.Append(name);
       RooArgList prodElems(*weight,*obj);
@@ -1596,9 +2883,9 @@ public:
     InternalType* morphfunc = makeSum(TString::Format("%s_morphfunc",name), name,sumElements,scaleElements);
     
     DEBUG("ownership handling");
-    DEBUG("... adding observable")
-    if(!observable) ERROR("unable to access observable");    
-    morphfunc->addServer(*observable);
+    DEBUG("... adding observables")
+    RooArgList obsList(observables);
+    morphfunc->addServerList(obsList);
     DEBUG("... adding bin width")
     if(!binWidth) ERROR("unable to access bin width");
     morphfunc->addServer(*binWidth);
@@ -1607,7 +2894,7 @@ public:
     morphfunc->addServerList(operators);
     DEBUG("... adding weights")
     if(this->_weights.getSize() < 1) ERROR("unable to access weight objects");
-    morphfunc->addOwnedComponents(this->_weights);
+    if(!this->_engine) morphfunc->addOwnedComponents(this->_weights);
 
     DEBUG("... adding temporary objects")
     morphfunc->addOwnedComponents(sumElements);
@@ -1626,16 +2913,62 @@ public:
     this->_sumFunc = morphfunc;
   }
 
+  static std::vector<double> getSampleVariances(const RooLagrangianMorphing::RooLagrangianMorphBase<Base>* func) {
+    // retrieve the total sum of squared weights of every input sample,
+    // which serves as statistical weight in least-squares morphing
+    std::vector<double> variances;
+    for(auto sampleit=func->_paramCards.begin(); sampleit!=func->_paramCards.end(); ++sampleit){
+      TString name(makeValidName(sampleit->first.c_str()));
+      auto it = func->_sampleMap.find(name.Data());
+      if(it == func->_sampleMap.end()) return std::vector<double>();
+      RooAbsArg* obj = func->_physics.at(it->second);
+      double variance = 0.;
+      RooHistFunc* hf = dynamic_cast<RooHistFunc*>(obj);
+      RooRealVar* rv = dynamic_cast<RooRealVar*>(obj);
+      if(hf){
+        const RooDataHist& hist = hf->dataHist();
+        for(Int_t j=0; j<hist.numEntries(); ++j){
+          hist.get(j);
+          variance += hist.weightSquared();
+        }
+      } else if(rv){
+        variance = pow(rv->getError(),2);
+      }
+      variances.push_back(variance);
+    }
+    return variances;
+  }
+
   static RooLagrangianMorphBase<Base>::CacheElem* createCache(const RooLagrangianMorphing::RooLagrangianMorphBase<Base>* func) {
     // create all the temporary objects required by the class
     DEBUG("creating cache for basePdf " << func);
+    PhaseTimer timer(&func->_statistics,RooLagrangianMorphing::CachePhase);
+    countEvent(&func->_statistics,&RooLagrangianMorphing::Statistics::cacheBuilds);
     RooLagrangianMorphing::ParamSet values = getParams(func->_operators);
 
     RooLagrangianMorphBase<Base>::CacheElem* cache = new RooLagrangianMorphBase<Base>::CacheElem();
-    cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags);
-
-    DEBUG("performing matrix operations");
-    cache->buildMatrix(func->_paramCards,func->_flagValues,func->_flags);
+    cache->_statistics = &func->_statistics;
+    std::shared_ptr<RooLagrangianMorphing::SharedCache> shared(func->_sharedCache);
+    if(shared){
+      // a clone of this function has already done the expensive work
+      DEBUG("reusing pattern and matrices shared between clones");
+      cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags,shared->_pattern);
+      cache->useShared(shared);
+    } else if(!func->_persistedInverse.empty()){
+      // the function was read from a file, rebuild from its compact representation
+      DEBUG("restoring pattern and matrices from persisted representation");
+      MorphFuncPattern pattern(func->_persistedPattern);
+      cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags,pattern);
+      std::stringstream ss(func->_persistedInverse);
+      cache->restoreMatrix(func->_paramCards,func->_flagValues,func->_flags,readMatrixFromStreamT<Matrix>(ss),func->_persistedCondition);
+      func->setSharedCache(cache->share(pattern));
+    } else {
+      MorphFuncPattern pattern;
+      cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags,pattern);
+      DEBUG("performing matrix operations");
+      cache->buildMatrix(func->_paramCards,func->_flagValues,func->_flags,getSampleVariances(func));
+      func->setSharedCache(cache->share(pattern));
+    }
     if(func->_obsName.size() == 0){
       ERROR("Matrix inversion succeeded, but no observable was supplied. quitting...");
       return cache;
@@ -1648,7 +2981,7 @@ public:
     #endif
     
     cache->buildMorphingFunction(func->GetName(),func->_paramCards,func->_sampleMap,func->_physics,
-                                 func->_allowNegativeYields,func->getObservable(),func->getBinWidth());
+                                 func->_allowNegativeYields,func->_observables,func->getBinWidth());
     setParams(values,func->_operators,true);
     return cache;
   }
@@ -1657,23 +2990,87 @@ public:
     // create all the temporary objects required by the class
     // function variant with precomputed inverse matrix
     DEBUG("creating cache for basePdf = " << func << " with matrix");
+    PhaseTimer timer(&func->_statistics,RooLagrangianMorphing::CachePhase);
+    countEvent(&func->_statistics,&RooLagrangianMorphing::Statistics::cacheBuilds);
     RooLagrangianMorphing::ParamSet values = getParams(func->_operators);
 
     RooLagrangianMorphBase<Base>::CacheElem* cache = new RooLagrangianMorphBase<Base>::CacheElem();
-    cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags);
+    cache->_statistics = &func->_statistics;
+    MorphFuncPattern pattern;
+    cache->createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags,pattern);
+    cache->restoreMatrix(func->_paramCards,func->_flagValues,func->_flags,inverse,NaN);
+    // publish the coefficients, such that clones and persisted copies use them as well
+    func->setSharedCache(cache->share(pattern));
 
+    DEBUG("building morphing function");        
+    cache->buildMorphingFunction(func->GetName(),func->_paramCards,func->_sampleMap,func->_physics,
+                                 func->_allowNegativeYields,func->_observables,func->getBinWidth());
+    setParams(values,func->_operators,true);
+    return cache;
+  }
+
+  static RooLagrangianMorphBase<Base>::CacheElem* createCache(const RooLagrangianMorphing::RooLagrangianMorphBase<Base>* func, const std::shared_ptr<RooLagrangianMorphing::WeightEngine>& engine) {
+    // create all the temporary objects required by the class
+    // function variant reusing the formulas, matrices and weights of a shared engine
+    DEBUG("creating cache for basePdf = " << func << " with shared weight engine");
+    PhaseTimer timer(&func->_statistics,RooLagrangianMorphing::CachePhase);
+    countEvent(&func->_statistics,&RooLagrangianMorphing::Statistics::cacheBuilds);
+    RooLagrangianMorphing::ParamSet values = getParams(func->_operators);
+
+    RooLagrangianMorphBase<Base>::CacheElem* cache = new RooLagrangianMorphBase<Base>::CacheElem();
+    cache->_statistics = &func->_statistics;
+    cache->_engine = engine;
+    cache->_couplings.add(engine->_couplings);
+    cache->_formulas = engine->_formulas;
 #ifndef USE_UBLAS
-    cache->_inverse.ResizeTo(inverse.GetNrows(),inverse.GetNrows());
+    cache->_matrix.ResizeTo(engine->_matrix.GetNrows(),engine->_matrix.GetNcols());
+    cache->_inverse.ResizeTo(engine->_inverse.GetNrows(),engine->_inverse.GetNcols());
 #endif
-    cache->_inverse = inverse;
-    cache->_condition = NaN;
+    cache->_matrix = engine->_matrix;
+    cache->_inverse = engine->_inverse;
+    cache->_condition = engine->_condition;
+    cache->_buildTime = engine->_buildTime;
+    cache->_inversionTime = engine->_inversionTime;
 
     DEBUG("building morphing function");        
     cache->buildMorphingFunction(func->GetName(),func->_paramCards,func->_sampleMap,func->_physics,
-                                 func->_allowNegativeYields,func->getObservable(),func->getBinWidth());
+                                 func->_allowNegativeYields,func->_observables,func->getBinWidth());
     setParams(values,func->_operators,true);
     return cache;
   }
+
+  static std::shared_ptr<RooLagrangianMorphing::WeightEngine> createWeightEngine(const RooLagrangianMorphing::RooLagrangianMorphBase<Base>* func) {
+    // build the formulas, the matrix and the sample weights of a function
+    // detached from its morphing function, such that they can be shared
+    DEBUG("creating weight engine for " << func);
+    RooLagrangianMorphing::ParamSet values = getParams(func->_operators);
+
+    RooLagrangianMorphBase<Base>::CacheElem tmp;
+    tmp._statistics = &func->_statistics;
+    tmp.createComponents(func->_paramCards,func->GetName(),func->_vertices,func->_nonInterfering,func->_flags);
+    tmp.buildMatrix(func->_paramCards,func->_flagValues,func->_flags,getSampleVariances(func));
+
+    std::shared_ptr<RooLagrangianMorphing::WeightEngine> engine(new RooLagrangianMorphing::WeightEngine());
+    RooArgList operators;
+    extractOperators(tmp._couplings,operators);
+    ::buildSampleWeights(engine->_weights,func->GetName(),func->_paramCards,tmp._formulas,tmp._inverse,tmp._couplings,operators);
+    engine->_couplings.add(tmp._couplings);
+    engine->_formulas = tmp._formulas;
+    tmp._formulas.clear();
+#ifndef USE_UBLAS
+    engine->_matrix.ResizeTo(tmp._matrix.GetNrows(),tmp._matrix.GetNcols());
+    engine->_inverse.ResizeTo(tmp._inverse.GetNrows(),tmp._inverse.GetNcols());
+#endif
+    engine->_matrix = tmp._matrix;
+    engine->_inverse = tmp._inverse;
+    engine->_condition = tmp._condition;
+    engine->_buildTime = tmp._buildTime;
+    engine->_inversionTime = tmp._inversionTime;
+    engine->_paramCards = func->_paramCards;
+    engine->_flagValues = func->_flagValues;
+    setParams(values,func->_operators,true);
+    return engine;
+  }
 };
 
 // specializations of the factory function
@@ -1703,19 +3100,75 @@ namespace {
   }
 
   template<class listT, class stringT>
-  void getArgs(RooWorkspace* ws, const std::vector<stringT>& names, listT& args){ 
+  void getArgs(const std::map<std::string,RooAbsArg*>& nodes, const std::vector<stringT>& names, listT& args){ 
+    // resolve names with a precomputed map rather than one workspace lookup each
     for(const auto& p:names){
-      RooAbsArg* v =(RooAbsArg*) ws->obj(p);
-      if(v){
-        args.add(*v);
+      auto it = nodes.find(std::string(p.Data()));
+      if(it != nodes.end()){
+        args.add(*(it->second));
+      }
+    }
+  }
+
+  std::map<std::string,RooAbsArg*> makeNodeMap(const RooAbsCollection& nodes){
+    // map the names of all nodes in a collection to the nodes
+    std::map<std::string,RooAbsArg*> map;
+    RooFIter itr(nodes.fwdIterator());
+    RooAbsArg* arg;
+    while((arg = itr.next())){
+      map[arg->GetName()] = arg;
+    }
+    return map;
+  }
+
+  bool isDataCompatible(const RooAbsData* data, const std::map<std::string,RooAbsArg*>& nodes){
+    // check if all variables of a dataset are nodes of the model
+    const RooArgSet* vars = data->get();
+    if(!vars) return false;
+    RooFIter itr(vars->fwdIterator());
+    RooAbsArg* arg;
+    while((arg = itr.next())){
+      if(nodes.find(arg->GetName()) == nodes.end()) return false;
+    }
+    return true;
+  }
+
+  unsigned long long workspaceMemory(const RooAbsCollection& nodes, const std::list<RooAbsData*>& data){
+    // estimate the memory held by the nodes and datasets of a workspace, in bytes
+    // the nodes are booked as in the memory report, datasets that are also
+    // templates of a node are only counted once
+    RooLagrangianMorphing::MemoryReport report;
+    std::set<const void*> seen;
+    RooFIter itr(nodes.fwdIterator());
+    RooAbsArg* arg;
+    while((arg = itr.next())){
+      addNodeMemory(arg,report,seen);
+    }
+    for(auto d:data){
+      if(!seen.insert(d).second) continue;
+      if(dynamic_cast<const RooDataHist*>(d)){
+        addMemory(report,RooLagrangianMorphing::TemplateMemory,sizeof(RooDataHist) + d->numEntries()*5*sizeof(double));
+      } else {
+        // one value per variable and entry, and the weight
+        const RooArgSet* vars = d->get();
+        addMemory(report,RooLagrangianMorphing::OtherNodeMemory,d->IsA()->Size() + d->numEntries()*((vars ? vars->getSize() : 0)+1)*sizeof(double));
       }
     }
+    unsigned long long total = 0;
+    for(int i=0; i<RooLagrangianMorphing::NMemoryCategories; ++i){
+      total += report.bytes[i];
+    }
+    return total;
   }
   
 }
 
-RooWorkspace* RooLagrangianMorphing::makeCleanWorkspace(RooWorkspace* oldWS, const char* newName, const char* mcname, bool keepData){
+RooWorkspace* RooLagrangianMorphing::makeCleanWorkspace(RooWorkspace* oldWS, const char* newName, const char* mcname, bool keepData, bool prune){
   // clone a workspace, copying all needed components and discarding all others
+  // in pruning mode, only the nodes reachable from the pdf and the datasets
+  // over these nodes are kept, and the reduction in size is reported
+  // templates of the model are shared with its nodes, other datasets are
+  // imported as they are, but the workspace always stores a copy of those
 	
   // butcher the old workspace
   auto objects = oldWS->allGenericObjects();
@@ -1757,16 +3210,58 @@ RooWorkspace* RooLagrangianMorphing::makeCleanWorkspace(RooWorkspace* oldWS, con
   RooAbsPdf* newPdf = newWS->pdf(pdf->GetName());
   newMC->SetPdf(*newPdf);
 
+  // the server graph of the model is walked once, the workspace only
+  // imports the nodes reachable from the pdf
+  RooArgSet reachable;
+  newPdf->treeNodeServerList(&reachable);
+  const std::map<std::string,RooAbsArg*> modelNodes(makeNodeMap(reachable));
+  // templates of the model are shared with its nodes rather than copied again
+  std::set<const RooAbsData*> templates;
+  if(prune){
+    RooFIter itr(reachable.fwdIterator());
+    RooAbsArg* arg;
+    while((arg = itr.next())){
+      RooHistFunc* hf = dynamic_cast<RooHistFunc*>(arg);
+      if(hf) templates.insert(&(hf->dataHist()));
+    }
+  }
+
+  size_t nData = 0;
+  size_t nEntries = 0;
+  size_t nEntriesTotal = 0;
   if(keepData){
     for(auto d:data){
-      newWS->import(*d);
+      nEntriesTotal += d->numEntries();
+      if(prune && !isDataCompatible(d,modelNodes)){
+        DEBUG("dropping dataset " << d->GetName() << ", which is not defined over observables of the model");
+        continue;
+      }
+      if(templates.find(d) != templates.end()){
+        DEBUG("sharing dataset " << d->GetName() << ", which is a template of the model");
+      } else {
+        newWS->import(*d);
+      }
+      nEntries += d->numEntries();
+      ++nData;
     }
   }
 
-  RooArgSet poiset; ::getArgs(newWS,poilist,poiset);
-  RooArgSet npset; ::getArgs(newWS,nplist,npset);
-  RooArgSet obsset; ::getArgs(newWS,obslist,obsset);
-  RooArgSet globobsset; ::getArgs(newWS,globobslist,globobsset);
+  // the datasets may bring variables that are not part of the model, such
+  // as global observables or parameters only used by the data, so the
+  // model config is resolved against the complete workspace
+  // in pruning mode, only the nodes of the model are eligible
+  const std::map<std::string,RooAbsArg*> nodes(makeNodeMap(prune ? reachable : newWS->components()));
+  RooArgSet poiset; ::getArgs(nodes,poilist,poiset);
+  RooArgSet npset; ::getArgs(nodes,nplist,npset);
+  RooArgSet obsset; ::getArgs(nodes,obslist,obsset);
+  RooArgSet globobsset; ::getArgs(nodes,globobslist,globobsset);
+
+  if(prune){
+    INFO("makeCleanWorkspace: kept " << newWS->components().getSize() << " of " << oldWS->components().getSize() << " nodes, "
+         << nData << " of " << (keepData ? data.size() : 0) << " datasets with " << nEntries << " of " << nEntriesTotal << " entries, "
+         << "and only the model config of " << objects.size() << " generic objects, "
+         << "estimated size " << workspaceMemory(oldWS->components(),data) << " -> " << workspaceMemory(newWS->components(),newWS->allData()) << " bytes");
+  }
 
   newMC->SetParametersOfInterest(poiset);
   newMC->SetNuisanceParameters  (npset);
@@ -1804,6 +3299,131 @@ double RooLagrangianMorphing::implementedPrecision(){
   return RooLagrangianMorphing::SuperFloatPrecision::digits10;
 }
 
+bool RooLagrangianMorphing::isPrecisionAvailable(RooLagrangianMorphing::Precision precision){
+  // check if a precision can be selected in this build
+  switch(precision){
+  case RooLagrangianMorphing::DefaultPrecision:
+  case RooLagrangianMorphing::DoublePrecision:
+  case RooLagrangianMorphing::LongDoublePrecision:
+  case RooLagrangianMorphing::DoubleDoublePrecision:
+    return true;
+  case RooLagrangianMorphing::QuadPrecision:
+#ifdef __SIZEOF_FLOAT128__
+    return true;
+#else
+    return false;
+#endif
+  case RooLagrangianMorphing::MultiPrecision:
+#ifdef USE_UBLAS
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+const char* RooLagrangianMorphing::getPrecisionName(RooLagrangianMorphing::Precision precision){
+  // retrieve a human readable name of a precision
+  switch(precision){
+  case RooLagrangianMorphing::DefaultPrecision: return "default";
+  case RooLagrangianMorphing::DoublePrecision: return "double";
+  case RooLagrangianMorphing::LongDoublePrecision: return "long double";
+  case RooLagrangianMorphing::DoubleDoublePrecision: return "double-double";
+  case RooLagrangianMorphing::QuadPrecision: return "__float128";
+  case RooLagrangianMorphing::MultiPrecision: return "cpp_dec_float<100>";
+  }
+  return "unknown";
+}
+
+const char* RooLagrangianMorphing::getPhaseName(RooLagrangianMorphing::Phase phase){
+  // retrieve the name of an instrumented phase, as used in the JSON output
+  switch(phase){
+  case RooLagrangianMorphing::CachePhase: return "cache";
+  case RooLagrangianMorphing::ComponentsPhase: return "components";
+  case RooLagrangianMorphing::FormulasPhase: return "formulas";
+  case RooLagrangianMorphing::MatrixFillPhase: return "matrix_fill";
+  case RooLagrangianMorphing::InversionPhase: return "inversion";
+  case RooLagrangianMorphing::SanityPhase: return "inverse_sanity";
+  case RooLagrangianMorphing::MorphingFunctionPhase: return "morphing_function";
+  case RooLagrangianMorphing::TemplatesPhase: return "templates";
+  case RooLagrangianMorphing::NPhases: break;
+  }
+  return "unknown";
+}
+
+const RooLagrangianMorphing::Statistics& RooLagrangianMorphing::getGlobalStatistics(){
+  // retrieve the timers and counters summed over all morphing objects of this process
+  return gGlobalStatistics;
+}
+
+void RooLagrangianMorphing::resetGlobalStatistics(){
+  // reset the timers and counters of this process
+  gGlobalStatistics = RooLagrangianMorphing::Statistics();
+}
+
+void RooLagrangianMorphing::writeStatistics(const RooLagrangianMorphing::Statistics& statistics, std::ostream& stream){
+  // write timers (in seconds) and counters as a JSON object
+  stream << "{\"phases\": {";
+  for(int i=0; i<RooLagrangianMorphing::NPhases; ++i){
+    stream << (i==0 ? "" : ", ") << "\"" << RooLagrangianMorphing::getPhaseName(RooLagrangianMorphing::Phase(i)) << "\": {\"time\": " << statistics.phaseTime[i] << ", \"calls\": " << statistics.phaseCalls[i] << "}";
+  }
+  stream << "}, \"evaluations\": " << statistics.evaluations;
+  stream << ", \"recomputations\": " << statistics.recomputations;
+  stream << ", \"cache_builds\": " << statistics.cacheBuilds << "}";
+}
+
+const char* RooLagrangianMorphing::getMemoryCategoryName(RooLagrangianMorphing::MemoryCategory category){
+  // retrieve the name of a memory category, as used in the JSON output
+  switch(category){
+  case RooLagrangianMorphing::TemplateMemory: return "templates";
+  case RooLagrangianMorphing::TemplateTableMemory: return "template_table";
+  case RooLagrangianMorphing::MatrixMemory: return "matrices";
+  case RooLagrangianMorphing::ProductMemory: return "RooProduct";
+  case RooLagrangianMorphing::ConstVarMemory: return "RooConstVar";
+  case RooLagrangianMorphing::LinearCombinationMemory: return "LinearCombination";
+  case RooLagrangianMorphing::OtherNodeMemory: return "other_nodes";
+  case RooLagrangianMorphing::NMemoryCategories: break;
+  }
+  return "unknown";
+}
+
+RooLagrangianMorphing::MemoryReport RooLagrangianMorphing::getGlobalMemoryReport(){
+  // estimate the memory held by all live morphing objects of this process
+  // objects shared between morphing objects are only counted once
+  RooLagrangianMorphing::MemoryReport report;
+  std::set<const void*> seen;
+  std::lock_guard<std::mutex> lock(memoryRegistryMutex());
+  for(const auto& instance:memoryRegistry()){
+    instance.second(report,seen);
+  }
+  return report;
+}
+
+void RooLagrangianMorphing::writeMemoryReport(const RooLagrangianMorphing::MemoryReport& report, std::ostream& stream){
+  // write a memory report (in bytes) as a JSON object
+  unsigned long long total = 0;
+  stream << "{\"instances\": " << report.instances << ", \"categories\": {";
+  for(int i=0; i<RooLagrangianMorphing::NMemoryCategories; ++i){
+    stream << (i==0 ? "" : ", ") << "\"" << RooLagrangianMorphing::getMemoryCategoryName(RooLagrangianMorphing::MemoryCategory(i)) << "\": {\"bytes\": " << report.bytes[i] << ", \"objects\": " << report.objects[i] << "}";
+    total += report.bytes[i];
+  }
+  stream << "}, \"total\": " << total << "}";
+}
+
+void RooLagrangianMorphing::printMemoryReport(const RooLagrangianMorphing::MemoryReport& report){
+  // print a memory report
+  unsigned long long total = 0;
+  std::cout << "memory held by " << report.instances << " morphing object(s):" << std::endl;
+  for(int i=0; i<RooLagrangianMorphing::NMemoryCategories; ++i){
+    std::cout << std::setw(20) << RooLagrangianMorphing::getMemoryCategoryName(RooLagrangianMorphing::MemoryCategory(i))
+              << std::setw(14) << report.bytes[i] << " bytes in "
+              << std::setw(8) << report.objects[i] << " objects" << std::endl;
+    total += report.bytes[i];
+  }
+  std::cout << std::setw(20) << "total" << std::setw(14) << total << " bytes" << std::endl;
+}
+
 // general static I/O utils
 void RooLagrangianMorphing::writeMatrixToFile(const TMatrixD& matrix, const char* fname){
   // write a matrix to a file
@@ -1825,11 +3445,174 @@ TMatrixD RooLagrangianMorphing::readMatrixFromStream(std::istream& stream){
   return readMatrixFromStreamT<TMatrixD>(stream);
 }
 
+namespace {
+  inline bool luDecompose(std::vector<double>& lu, std::vector<size_t>& perm, size_t n, double& logdet){
+    // in-place LU decomposition of a row-major matrix with partial pivoting, PA = LU
+    perm.resize(n);
+    for(size_t i=0; i<n; ++i) perm[i] = i;
+    logdet = 0.;
+    for(size_t k=0; k<n; ++k){
+      size_t piv = k;
+      for(size_t i=k+1; i<n; ++i){
+        if(fabs(lu[i*n+k]) > fabs(lu[piv*n+k])) piv = i;
+      }
+      if(lu[piv*n+k] == 0.) return false;
+      if(piv != k){
+        for(size_t j=0; j<n; ++j) std::swap(lu[piv*n+j],lu[k*n+j]);
+        std::swap(perm[piv],perm[k]);
+      }
+      logdet += log(fabs(lu[k*n+k]));
+      for(size_t i=k+1; i<n; ++i){
+        lu[i*n+k] /= lu[k*n+k];
+        const double l = lu[i*n+k];
+        if(l == 0.) continue;
+        for(size_t j=k+1; j<n; ++j){
+          lu[i*n+j] -= l * lu[k*n+j];
+        }
+      }
+    }
+    return true;
+  }
+  inline void luSolve(const std::vector<double>& lu, const std::vector<size_t>& perm, size_t n, const std::vector<double>& b, std::vector<double>& x){
+    // solve A x = b given the decomposition PA = LU
+    x.resize(n);
+    for(size_t i=0; i<n; ++i){
+      double v = b[perm[i]];
+      for(size_t j=0; j<i; ++j) v -= lu[i*n+j] * x[j];
+      x[i] = v;
+    }
+    for(size_t i=n; i-- > 0;){
+      double v = x[i];
+      for(size_t j=i+1; j<n; ++j) v -= lu[i*n+j] * x[j];
+      x[i] = v / lu[i*n+i];
+    }
+  }
+  inline void luSolveTransposed(const std::vector<double>& lu, const std::vector<size_t>& perm, size_t n, const std::vector<double>& b, std::vector<double>& x){
+    // solve A^T x = b given the decomposition PA = LU, using A^T = U^T L^T P
+    std::vector<double> u(n);
+    for(size_t i=0; i<n; ++i){
+      double v = b[i];
+      for(size_t j=0; j<i; ++j) v -= lu[j*n+i] * u[j];
+      u[i] = v / lu[i*n+i];
+    }
+    for(size_t i=n; i-- > 0;){
+      double v = u[i];
+      for(size_t j=i+1; j<n; ++j) v -= lu[j*n+i] * u[j];
+      u[i] = v;
+    }
+    x.resize(n);
+    for(size_t i=0; i<n; ++i) x[perm[i]] = u[i];
+  }
+}
+
+double RooLagrangianMorphing::estimateCondition(const std::vector<double>& matrix, size_t n, double* logdet){
+  // estimate the 1-norm condition number of a row-major n x n matrix
+  // this uses a double precision LU decomposition and Hager's estimate of
+  // the norm of the inverse (with Higham's safeguard), which only costs a
+  // few triangular solves instead of a full inversion. singular matrices
+  // return infinity, logdet (if given) receives log|det(matrix)|
+  // if gEquilibrate is set, this is the condition of the equilibrated matrix,
+  // as for the inversion of the morphing matrix
+  const double inf = std::numeric_limits<double>::infinity();
+  if(logdet) *logdet = -inf;
+  if(matrix.size() != n*n){
+    ERROR("matrix has " << matrix.size() << " entries, expected " << n*n);
+    return inf;
+  }
+  if(n == 0) return 0.;
+  std::vector<double> scaled(matrix);
+  double logscale = 0.;
+  if(RooLagrangianMorphing::gEquilibrate){
+    std::vector<double> rowScale, colScale;
+    computeEquilibration(matrix,n,rowScale,colScale);
+    for(size_t i=0; i<n; ++i){
+      for(size_t j=0; j<n; ++j){
+        scaled[i*n+j] *= rowScale[i]*colScale[j];
+      }
+      logscale += std::log(rowScale[i]) + std::log(colScale[i]);
+    }
+  }
+  std::vector<double> lu(scaled);
+  std::vector<size_t> perm;
+  double ld;
+  if(!luDecompose(lu,perm,n,ld)) return inf;
+  // the determinant of the scaled matrix carries the product of the scale factors
+  if(logdet) *logdet = ld - logscale;
+  double anorm = 0.;
+  for(size_t j=0; j<n; ++j){
+    double colsum = 0.;
+    for(size_t i=0; i<n; ++i) colsum += fabs(scaled[i*n+j]);
+    anorm = std::max(anorm,colsum);
+  }
+  std::vector<double> x(n,1./n);
+  std::vector<double> y,z;
+  std::vector<double> xi(n);
+  double inorm = 0.;
+  size_t jlast = n;
+  for(int iter=0; iter<5; ++iter){
+    luSolve(lu,perm,n,x,y);
+    inorm = 0.;
+    for(size_t i=0; i<n; ++i){
+      inorm += fabs(y[i]);
+      xi[i] = (y[i] >= 0. ? 1. : -1.);
+    }
+    luSolveTransposed(lu,perm,n,xi,z);
+    size_t jmax = 0;
+    double ztx = 0.;
+    for(size_t i=0; i<n; ++i){
+      if(fabs(z[i]) > fabs(z[jmax])) jmax = i;
+      ztx += z[i] * x[i];
+    }
+    if(fabs(z[jmax]) <= ztx || jmax == jlast) break;
+    x.assign(n,0.);
+    x[jmax] = 1.;
+    jlast = jmax;
+  }
+  for(size_t i=0; i<n; ++i){
+    x[i] = (i % 2 ? -1. : 1.) * (1. + double(i) / std::max(n-1,size_t(1)));
+  }
+  luSolve(lu,perm,n,x,y);
+  double alt = 0.;
+  for(size_t i=0; i<n; ++i) alt += fabs(y[i]);
+  inorm = std::max(inorm,2.*alt/(3.*n));
+  const double condition = anorm * inorm;
+  if(std::isnan(condition)) return inf;
+  return condition;
+}
+
+double RooLagrangianMorphing::estimateCondition(const TMatrixD& matrix, double* logdet){
+  // estimate the 1-norm condition number of a square matrix
+  if(matrix.GetNrows() != matrix.GetNcols()){
+    ERROR("cannot estimate the condition of a non-square matrix!");
+  }
+  const size_t n = matrix.GetNrows();
+  const std::vector<double> values(matrix.GetMatrixArray(),matrix.GetMatrixArray()+n*n);
+  return estimateCondition(values,n,logdet);
+}
+
+bool RooLagrangianMorphing::invertFlatMatrix(const std::vector<double>& matrix, size_t n, std::vector<double>& inverse, double* unityDeviation){
+  // invert a row-major n x n matrix with the precision (gInversionPrecision) and
+  // equilibration (gEquilibrate) used for the morphing matrix. no RooFit objects
+  // are involved, such that this can be called concurrently. unityDeviation (if
+  // given) receives the largest deviation of matrix*inverse from unity
+  if(matrix.size() != n*n){
+    ERROR("matrix has " << matrix.size() << " entries, expected " << n*n);
+    return false;
+  }
+  std::vector<WideFloat> result;
+  if(!invertMatrixPrecisionEquilibrated(matrix,n,RooLagrangianMorphing::gInversionPrecision,result)) return false;
+  inverse.resize(n*n);
+  for(size_t i=0; i<n*n; ++i) inverse[i] = convertNumber<double>(result[i]);
+  if(unityDeviation) *unityDeviation = unityDeviationPrecision(matrix,result,n);
+  return true;
+}
+
 //_____________________________________________________________________________
 
 template<class Base>
 RooRealVar* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::setupObservable(const char* obsname,TClass* mode,TObject* inputExample){
-  // Recycle existing observable, if defined
+  // Recycle existing observables, if defined
+  // multi-dimensional histograms get one observable per axis
   DEBUG("setting up observable");
   RooRealVar* obs = NULL;
   Bool_t obsExists(false) ;
@@ -1837,41 +3620,58 @@ RooRealVar* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::setupObservable
     obs = (RooRealVar*)this->_observables.at(0) ;
     obsExists = true ;
   }
+  RooAbsCollection* inputObservables = NULL;
   if(mode && mode->InheritsFrom(RooHistFunc::Class())){
-    obs = (RooRealVar*)(HistFuncAccessor::getObservables((RooHistFunc*)inputExample)->first());
-    obsExists = true ;
-    this->_observables.add(*obs) ;
+    inputObservables = HistFuncAccessor::getObservables((RooHistFunc*)inputExample);
   } else if(mode && mode->InheritsFrom(RooParamHistFunc::Class())){
-    obs = (RooRealVar*)(ParamHistFuncAccessor::getObservables((RooParamHistFunc*)inputExample)->first());
+    inputObservables = ParamHistFuncAccessor::getObservables((RooParamHistFunc*)inputExample);
+  }
+  if(inputObservables){
+    obs = (RooRealVar*)(inputObservables->first());
     obsExists = true ;
-    this->_observables.add(*obs) ;
+    RooFIter itr(inputObservables->fwdIterator());
+    RooAbsArg* arg;
+    while((arg = itr.next())){
+      this->_observables.add(*arg) ;
+    }
   }
     
   // obtain the observable
   if (!obsExists){
-    if(mode && mode->InheritsFrom(TH1::Class())){
-      DEBUG("getObservable: creating new multi-bin observable object " << obsname);      
-      TH1* hist = (TH1*)(inputExample);
-      obs = new RooRealVar(obsname,obsname,hist->GetXaxis()->GetXmin(),hist->GetXaxis()->GetXmax());
-      obs->setBins(hist->GetNbinsX());
+    const std::vector<const TAxis*> axes(getHistogramAxes(inputExample));
+    if(mode && axes.size() > 0){
+      const std::vector<std::string> names(makeObservableNames(obsname,axes.size()));
+      for(size_t i=0; i<axes.size(); ++i){
+        DEBUG("getObservable: creating new multi-bin observable object " << names[i]);      
+        RooRealVar* var = new RooRealVar(names[i].c_str(),names[i].c_str(),axes[i]->GetXmin(),axes[i]->GetXmax());
+        var->setBins(axes[i]->GetNbins());
+        this->_observables.add(*var) ;
+      }
+      obs = (RooRealVar*)this->_observables.at(0) ;
     } else {
       DEBUG("getObservable: creating new single-bin observable object " << obsname);
       obs = new RooRealVar(obsname,obsname,0,1);
       obs->setBins(1);
+      this->_observables.add(*obs) ;
     }
-    this->_observables.add(*obs) ;
   } else {
     DEBUG("getobservable: recycling existing observable object " << this->_observables.at(0));
-    if (strcmp(obsname,obs->GetName())!=0 ) {
-      std::cerr << "WARNING: name of existing observable " << this->_observables.at(0)->GetName() << " does not match expected name " << obsname << std::endl ;
+    const std::string expected(makeObservableNames(obsname,this->_observables.getSize()).at(0));
+    if (expected != obs->GetName()) {
+      std::cerr << "WARNING: name of existing observable " << this->_observables.at(0)->GetName() << " does not match expected name " << expected << std::endl ;
     }     
   }
 
   
   DEBUG("managing bin width");
+  // the bin width is the inverse bin volume in all dimensions
   TString sbw = TString::Format("binWidth_%s",makeValidName(obs->GetName()).Data());
   RooRealVar* binWidth = new RooRealVar(sbw.Data(),sbw.Data(),1.);
-  double bw = obs->numBins()/(obs->getMax() - obs->getMin());
+  double bw = 1.;
+  for(int i=0; i<this->_observables.getSize(); ++i){
+    RooRealVar* var = (RooRealVar*)this->_observables.at(i);
+    bw *= var->numBins()/(var->getMax() - var->getMin());
+  }
   binWidth->setVal(bw);
   binWidth->setConstant(true);
   this->_binWidths.add(*binWidth);
@@ -1881,13 +3681,8 @@ RooRealVar* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::setupObservable
   
 //_____________________________________________________________________________
 
-#ifndef USE_UBLAS
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#endif
 template <class Base>
 inline void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::updateSampleWeights(){
-#ifdef USE_UBLAS
   int sampleidx = 0;
   auto cache = this->getCache(_curNormSet);  
   const size_t n(size(cache->_inverse));
@@ -1911,13 +3706,7 @@ inline void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::updateSampleWei
     sampleformula->setValueDirty();
     ++sampleidx;
   }
-#else
-  ERROR("updating sample weights currently not possible without boost!");
-#endif
 }
-#ifndef USE_UBLAS
-#pragma GCC diagnostic pop
-#endif
 
 //_____________________________________________________________________________
 
@@ -1941,10 +3730,10 @@ void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::collectInputs(TDirecto
   if(!obj) ERROR("unable to locate object '"<<this->_objFilter<<"' in folder '" << base << "'!");    
   TClass* mode = TClass::GetClass(obj->ClassName());
 
-  RooRealVar* observable = this->setupObservable(this->_obsName.c_str(),mode,obj);
-  if(mode->InheritsFrom(TH1::Class())){
+  this->setupObservable(this->_obsName.c_str(),mode,obj);
+  if(mode->InheritsFrom(TH1::Class()) || mode->InheritsFrom(THnBase::Class())){
     DEBUG("using TH1");
-    collectHistograms(this->GetName(), file, this->_sampleMap,this->_physics,*observable, this->_objFilter, _baseFolder, this->_paramCards);
+    collectHistograms(this->GetName(), file, this->_sampleMap,this->_physics,this->_observables, this->_objFilter, _baseFolder, this->_paramCards);
   } else if(mode->InheritsFrom(RooHistFunc::Class()) || mode->InheritsFrom(RooParamHistFunc::Class()) || mode->InheritsFrom(PiecewiseInterpolation::Class())){
     DEBUG("using RooHistFunc");      
     collectRooAbsReal(this->GetName(), file, this->_sampleMap,this->_physics, this->_objFilter, this->_paramCards);
@@ -2031,6 +3820,7 @@ RooLagrangianMorphing::RooLagrangianMorphBase<Base>::RooLagrangianMorphBase(cons
   this->printAuthors();
   this->addFolders(folders);
   this->init();
+  registerInstance(this,[this](RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen){ this->fillMemoryReport(report,seen); });
   DEBUG("constructor completed");
 }
 
@@ -2371,6 +4161,11 @@ RooLagrangianMorphing::RooLagrangianMorphBase<Base>::RooLagrangianMorphBase(cons
   _observables(other._observables.GetName(),this,other._observables),
   _binWidths  (other._binWidths.GetName(),  this,other._binWidths),
   _flags      (other._flags.GetName(),      this,other._flags),
+  _weightEngine(other._weightEngine),
+  _sharedCache(other._sharedCache),
+  _persistedInverse(other._persistedInverse),
+  _persistedCondition(other._persistedCondition),
+  _persistedPattern(other._persistedPattern),
   _curNormSet(0)
 {
   // copy constructor
@@ -2379,6 +4174,7 @@ RooLagrangianMorphing::RooLagrangianMorphBase<Base>::RooLagrangianMorphBase(cons
     RooListProxy* list = new RooListProxy(other._vertices[i]->GetName(),this,*(other._vertices[i]));
     this->_vertices.push_back(list);
   }
+  registerInstance(this,[this](RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen){ this->fillMemoryReport(report,seen); });
 }
 
 //_____________________________________________________________________________
@@ -2393,6 +4189,7 @@ RooLagrangianMorphing::RooLagrangianMorphBase<Base>::RooLagrangianMorphBase() :
   DEBUG("default constructor called: " << this << " " << counter);
   counter++;
   this->printAuthors();
+  registerInstance(this,[this](RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen){ this->fillMemoryReport(report,seen); });
 }
 
 //_____________________________________________________________________________
@@ -2400,6 +4197,7 @@ template <class Base>
 RooLagrangianMorphing::RooLagrangianMorphBase<Base>::~RooLagrangianMorphBase() {
   // default destructor
   DEBUG("destructor called");
+  unregisterInstance(this);
   for(auto v:this->_vertices){
     delete v;
   }
@@ -2487,6 +4285,57 @@ RooArgSet RooLagrangianMorphing::createWeights(const RooLagrangianMorphing::Para
   return retval;
 }
 
+//_____________________________________________________________________________
+std::vector<std::string> RooLagrangianMorphing::selectSamples(const RooLagrangianMorphing::ParamMap& pool, const std::vector<RooArgList*>& vertices, RooArgList& couplings, const RooLagrangianMorphing::FlagMap& flagValues, const RooArgList& flags, const std::vector<RooArgList*>& nonInterfering){
+  // select the subset of samples from a pool that gives the best-conditioned
+  // morphing, using only the (cheap) monomials of the morphing polynomials
+  // the selection fails if the pool cannot constrain all the polynomials
+  std::vector<std::string> selection;
+  VertexMap vertexmap(buildVertexMap<RooArgList>(vertices,couplings));
+  MorphFuncPattern morphfuncpattern(calculateFunction(vertexmap));
+  FormulaList formulas = ::buildFormulas("",pool,morphfuncpattern,couplings,flags,nonInterfering);
+  const size_t nformulas = formulas.size();
+  if(nformulas == 0){
+    ERROR("no formulas are non-zero, check if any if your couplings is floating and missing from your param_cards!");
+    return selection;
+  }
+  if(pool.size() < nformulas){
+    for(auto& formula:formulas) delete formula.second;
+    ERROR("pool of " << pool.size() << " samples is too small, at least " << nformulas << " are required!");
+    return selection;
+  }
+  RooArgSet operators;
+  extractOperators(couplings,operators);
+  RooLagrangianMorphing::ParamSet values = getParams(operators);
+  TMatrixD matrix(::buildMatrixT<TMatrixD>(pool,formulas,operators,flagValues,flags));
+  setParams(values,operators,true);
+  for(auto& formula:formulas) delete formula.second;
+  const size_t nrows = matrix.GetNrows();
+  std::vector<double> flat(nrows*nformulas);
+  for(size_t i=0; i<nrows; ++i){
+    for(size_t j=0; j<nformulas; ++j) flat[i*nformulas+j] = matrix(i,j);
+  }
+  std::vector<size_t> rows;
+  const size_t rank = selectRows(flat,nrows,nformulas,rows);
+  if(rank < nformulas){
+    ERROR("pool is rank deficient, its samples only constrain " << rank << " of " << nformulas << " polynomials!");
+    return selection;
+  }
+  std::vector<std::string> names;
+  for(const auto& sample:pool) names.push_back(sample.first);
+  for(const auto& row:rows) selection.push_back(names[row]);
+  return selection;
+}
+
+//_____________________________________________________________________________
+std::vector<std::string> RooLagrangianMorphing::selectSamples(const RooLagrangianMorphing::ParamMap& pool, const std::vector<RooArgList*>& vertices, RooArgList& couplings){
+  // select the subset of samples from a pool that gives the best-conditioned morphing
+  std::vector<RooArgList*> nonInterfering;
+  RooArgList flags;
+  FlagMap flagValues;
+  return RooLagrangianMorphing::selectSamples(pool,vertices,couplings,flagValues,flags,nonInterfering);
+}
+
 //_____________________________________________________________________________
 RooArgSet RooLagrangianMorphing::createWeights(const RooLagrangianMorphing::ParamMap& inputs, const std::vector<RooArgList*>& vertices, RooArgList& couplings){
   // create only the weight formulas. static function for external usage.
@@ -2553,12 +4402,19 @@ const std::vector<std::string>& RooLagrangianMorphing::RooLagrangianMorphBase<Ba
 template <class Base>
 RooAbsReal* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getSampleWeight(const char* name){
   // retrieve the weight (prefactor) of a sample with the given name
+  // the weights are resolved by sample index rather than by name, since the
+  // weights of a shared engine are named after the function that built it
   auto cache = this->getCache(_curNormSet);
-  TString wname(name);
-  wname.Prepend("w_");
-  wname.Append("_");
-  wname.Append(this->GetName());
-  return dynamic_cast<RooAbsReal*>(cache->_weights.find(wname));
+  const TString validName(makeValidName(name));
+  int idx = 0;
+  for(auto sampleit=this->_paramCards.begin(); sampleit!=this->_paramCards.end(); ++sampleit){
+    if(sampleit->first == name || validName == makeValidName(sampleit->first.c_str())){
+      if(idx >= cache->_weights.getSize()) return NULL;
+      return dynamic_cast<RooAbsReal*>(cache->_weights.at(idx));
+    }
+    ++idx;
+  }
+  return NULL;
 }
 
 //_____________________________________________________________________________
@@ -2597,6 +4453,10 @@ void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::randomizeParameters(do
 //_____________________________________________________________________________
 template <class Base>
 bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::updateCoefficients(){
+  if(this->_weightEngine){
+    ERROR("unable to update the coefficients of a function using a shared weight engine!");
+    return false;
+  }
   auto cache = this->getCache(_curNormSet);
 
   TDirectory* file = openFile(this->_fileName);
@@ -2612,8 +4472,11 @@ bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::updateCoefficients(){
   this->readParameters(file);
   checkNameConflict(this->_paramCards,this->_operators);
   this->collectInputs(file);
+  cache->_templatesValid = false;
 
-  cache->buildMatrix(this->_paramCards,this->_flagValues,this->_flags);
+  cache->buildMatrix(this->_paramCards,this->_flagValues,this->_flags,RooLagrangianMorphBase<Base>::CacheElem::getSampleVariances(this));
+  // clones keep the previous matrices, new clones pick up the updated ones
+  this->setSharedCache(cache->share(cache->_shared ? cache->_shared->_pattern : MorphFuncPattern()));
   
   // then, update the weights in the morphing function
   this->updateSampleWeights();
@@ -2627,11 +4490,18 @@ template <class Base>
 bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::useCoefficients(const TMatrixD& inverse){
   // setup the morphing function with a predefined inverse matrix
   // call this function *before* any other after creating the object
+  if(this->_weightEngine){
+    ERROR("unable to use predefined coefficients for a function using a shared weight engine!");
+    return false;
+  }
   RooLagrangianMorphBase<Base>::CacheElem* cache = (RooLagrangianMorphBase<Base>::CacheElem*) _cacheMgr.getObj(0,(RooArgSet*)0);
   Matrix m = makeSuperMatrix(inverse);
   if (cache) {
-#ifdef USE_UBLAS
+#ifndef USE_UBLAS
+    cache->_inverse.ResizeTo(m.GetNrows(),m.GetNcols());
+#endif
     cache->_inverse = m;
+    this->setSharedCache(cache->share(cache->_shared ? cache->_shared->_pattern : MorphFuncPattern()));
     TDirectory* file = openFile(this->_fileName);
     if(!file) ERROR("unable to open file '"<<this->_fileName<<"'!");
     DEBUG("reading parameter sets.");
@@ -2640,14 +4510,12 @@ bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::useCoefficients(const
     this->readParameters(file);
     checkNameConflict(this->_paramCards,this->_operators);
     this->collectInputs(file);
+    cache->_templatesValid = false;
     
     // then, update the weights in the morphing function
     this->updateSampleWeights();
 
     closeFile(file);
-#else
-    return false;
-#endif
   } else {
     cache = RooLagrangianMorphBase<Base>::CacheElem::createCache(this,m);
     if(!cache) ERROR("unable to create cache!");
@@ -2661,6 +4529,10 @@ template <class Base>
 bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::useCoefficients(const char* filename){
   // setup the morphing function with a predefined inverse matrix
   // call this function *before* any other after creating the object
+  if(this->_weightEngine){
+    ERROR("unable to use predefined coefficients for a function using a shared weight engine!");
+    return false;
+  }
   RooLagrangianMorphBase<Base>::CacheElem* cache = (RooLagrangianMorphBase<Base>::CacheElem*) _cacheMgr.getObj(0,(RooArgSet*)0);
   if (cache) {
     return false;
@@ -2681,6 +4553,56 @@ bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::writeCoefficients(cons
   return true;
 }
 
+//_____________________________________________________________________________
+template <class Base>
+std::shared_ptr<RooLagrangianMorphing::WeightEngine> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getWeightEngine(){
+  // retrieve the weight engine of this function, building it if necessary
+  // the engine can be passed to setWeightEngine of other morphing functions
+  // built from the same samples and coupling objects, e.g. one per region
+  // or observable, such that the matrix is built and inverted only once and
+  // the sample weights are evaluated only once per parameter point
+  // the coupling objects need to outlive the engine
+  if(this->_weightEngine) return this->_weightEngine;
+  std::shared_ptr<RooLagrangianMorphing::WeightEngine> engine(RooLagrangianMorphBase<Base>::CacheElem::createWeightEngine(this));
+  this->setWeightEngine(engine);
+  return engine;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::setWeightEngine(const std::shared_ptr<RooLagrangianMorphing::WeightEngine>& engine){
+  // use the formulas, matrices and sample weights of a shared weight engine
+  // passing an empty pointer restores the private weights of this function
+  if(engine){
+    RooArgList couplings;
+    for(auto vertex : this->_vertices){
+      extractCouplings(*vertex,couplings);
+    }
+    if(!engine->isCompatible(this->_paramCards,this->_flagValues,couplings)){
+      ERROR("unable to use weight engine for '" << this->GetName() << "', the param cards, flags or coupling objects differ!");
+      return false;
+    }
+  }
+  this->_weightEngine = engine;
+  this->_cacheMgr.reset();
+  this->setValueDirty();
+  return true;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::setSharedCache(const std::shared_ptr<RooLagrangianMorphing::SharedCache>& shared) const {
+  // keep the shared part of the cache, along with the compact representation
+  // that is written to files and workspaces, the inverse matrix (as text to
+  // retain the full precision), its condition and the formula pattern
+  this->_sharedCache = shared;
+  std::stringstream ss;
+  writeMatrixToStreamT(shared->_inverse,ss);
+  this->_persistedInverse = ss.str();
+  this->_persistedCondition = shared->_condition;
+  this->_persistedPattern = shared->_pattern;
+}
+
 //_____________________________________________________________________________
 template <class Base>
 typename RooLagrangianMorphing::RooLagrangianMorphBase<Base>::CacheElem* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getCache(const RooArgSet* /*nset*/) const {
@@ -2694,7 +4616,24 @@ typename RooLagrangianMorphing::RooLagrangianMorphBase<Base>::CacheElem* RooLagr
     #endif
     
     DEBUG("current storage has size " << this->_sampleMap.size());
-    cache = RooLagrangianMorphBase<Base>::CacheElem::createCache(this);
+    if(this->_weightEngine){
+      // clones inherit the engine, but a deep clone (e.g. for a likelihood) or a
+      // server redirection replaces the couplings, which the engine weights do
+      // not follow. such functions fall back to private weights
+      RooArgList couplings;
+      for(auto vertex : this->_vertices){
+        extractCouplings(*vertex,couplings);
+      }
+      if(!this->_weightEngine->isCompatible(this->_paramCards,this->_flagValues,couplings)){
+        INFO("weight engine is not compatible with the coupling objects of '" << this->GetName() << "', using private weights");
+        this->_weightEngine.reset();
+      }
+    }
+    if(this->_weightEngine){
+      cache = RooLagrangianMorphBase<Base>::CacheElem::createCache(this,this->_weightEngine);
+    } else {
+      cache = RooLagrangianMorphBase<Base>::CacheElem::createCache(this);
+    }
     if(cache) this->_cacheMgr.setObj(0,0,cache,0);
     else ERROR("unable to create cache!");
   }
@@ -2866,6 +4805,27 @@ RooRealVar* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getObservable()
 
 //_____________________________________________________________________________
 
+template<class Base>
+const RooArgList& RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getObservables() const {
+  // retrieve the histogram observables, one per axis of the input templates
+  return this->_observables;
+}
+
+//_____________________________________________________________________________
+
+template<class Base>
+int RooLagrangianMorphing::RooLagrangianMorphBase<Base>::nBins() const {
+  // retrieve the total number of bins, the product of the bins of all observables
+  if(this->_observables.getSize() < 1) return 0;
+  int nbins = 1;
+  for(int i=0; i<this->_observables.getSize(); ++i){
+    nbins *= static_cast<RooRealVar*>(this->_observables.at(i))->getBins();
+  }
+  return nbins;
+}
+
+//_____________________________________________________________________________
+
 template<class Base>
 RooRealVar* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getBinWidth() const {
   // retrieve the histogram observable
@@ -2885,45 +4845,168 @@ TH1* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::createTH1(const std::s
 template <class Base>
 TH1* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::createTH1(const std::string& name, bool correlateErrors, RooFitResult* r){
   // retrieve a histogram output of the current morphing settings
-  InternalType* pdf = this->getInternal();
-  RooRealVar* observable = this->getObservable();
+  // every weight is evaluated once, the bins are then filled from the
+  // template table of the cache in a single pass
+  // two- and three-dimensional inputs yield a TH2 or TH3, inputs with more
+  // axes are unrolled into a TH1 over the flat bin index
+  auto cache = this->getCache(_curNormSet);
+  if(!cache->_templatesValid) cache->updateTemplates();
+  const RooArgList& observables = this->getObservables();
   
-  const int nbins = observable->getBins();
+  const int nbins = this->nBins();
   
-  TH1* hist = new TH1F(name.c_str(),name.c_str(),nbins,observable->getBinning().array());
+  TH1* hist = makeEmptyHistogram(name.c_str(),observables);
   
   bool ownResult = !(bool)(r);
-  RooArgSet* args = pdf->getComponents();
-  TObject* obj;
-  for (int i=0; i<nbins; ++i) {
-    observable->setBin(i);
-    RooFIter itr(args->fwdIterator());
-    double val = 0;
-    double unc2 = 0;
-    double unc = 0;
-    while((obj = itr.next())){
-      RooProduct* prod = dynamic_cast<RooProduct*>(obj);
-      if(!prod) continue;
-      RooAbsArg* phys = prod->components().find(TString::Format("phys_%s",prod->GetName()));
-      RooHistFunc* hf = dynamic_cast<RooHistFunc*>(phys);
-      if(!hf){
-        continue;
-      }
-      const RooDataHist& dhist = hf->dataHist();
-      dhist.get(i);
-      RooAbsReal* formula = dynamic_cast<RooAbsReal*>(prod->components().find(TString::Format("w_%s",prod->GetName())));
-      double weight = formula->getVal();
-      unc2 += dhist.weightSquared()*weight*weight;
-      unc += sqrt(dhist.weightSquared())*weight;
-      val += dhist.weight()*weight;
+  std::vector<double> val(nbins,0.);
+  std::vector<double> unc2(nbins,0.);
+  std::vector<double> unc(nbins,0.);
+  for(size_t c=0; c<cache->_componentWeights.size(); ++c){
+    const std::vector<double>& contents = cache->_templates->contents[c];
+    if(contents.empty()) continue;
+    const std::vector<double>& sumw2 = cache->_templates->sumw2[c];
+    const std::vector<double>& errors = cache->_templates->errors[c];
+    const double weight = cache->_componentWeights[c]->getVal();
+    const size_t n = std::min(contents.size(),size_t(nbins));
+    for(size_t i=0; i<n; ++i){
+      // contributions clamped to zero by the function carry no uncertainty either
+      if(!this->_allowNegativeYields && contents[i]*weight < 0) continue;
+      val[i]  += contents[i]*weight;
+      unc2[i] += sumw2[i]*weight*weight;
+      unc[i]  += errors[i]*weight;
+    }
   }
-    hist->SetBinContent(i+1,val);
-    hist->SetBinError(i+1,correlateErrors ? unc : sqrt(unc2));
+  std::vector<double> parunc2(nbins,0.);
+  if(r){
+    // propagate the uncertainties of the fitted parameters
+    const TMatrixD parcov(this->createParameterCovarianceMatrix(r));
+    for (int i=0; i<nbins; ++i) parunc2[i] = parcov(i,i);
+  }
+  for (int i=0; i<nbins; ++i) {
+    const Int_t bin = getGlobalBin(hist,observables,i);
+    hist->SetBinContent(bin,val[i]);
+    const double statunc2 = correlateErrors ? unc[i]*unc[i] : unc2[i];
+    hist->SetBinError(bin,sqrt(statunc2 + parunc2[i]));
   }
   if(ownResult) delete r;
   return hist;
 }
 
+//_____________________________________________________________________________
+template <class Base>
+TMatrixD RooLagrangianMorphing::RooLagrangianMorphBase<Base>::createTemplateCovarianceMatrix(const TMatrixD* sampleCorrelation) const {
+  // retrieve the bin-by-bin covariance of the morphed distribution due to
+  // the limited statistics of the input templates, W^T Sigma W for every bin
+  // the templates are taken to be independent across bins, the samples are
+  // independent unless a sample correlation matrix (in the order of the
+  // samples, see getSamples) is given
+  auto cache = this->getCache(_curNormSet);
+  if(!cache->_templatesValid) cache->updateTemplates();
+  const int nbins = this->nBins();
+  const size_t nsamples = cache->_componentWeights.size();
+  if(sampleCorrelation && (size_t(sampleCorrelation->GetNrows()) != nsamples || size_t(sampleCorrelation->GetNcols()) != nsamples)){
+    ERROR("sample correlation matrix has dimension " << sampleCorrelation->GetNrows() << "x" << sampleCorrelation->GetNcols() << ", expected " << nsamples << "x" << nsamples);
+  }
+  std::vector<double> weights(nsamples);
+  for(size_t s=0; s<nsamples; ++s){
+    weights[s] = cache->_componentWeights[s]->getVal();
+  }
+  TMatrixD cov(nbins,nbins);
+  std::vector<double> v(nsamples);
+  for(int i=0; i<nbins; ++i){
+    // v = w * sigma for this bin
+    for(size_t s=0; s<nsamples; ++s){
+      const std::vector<double>& errors = cache->_templates->errors[s];
+      const std::vector<double>& contents = cache->_templates->contents[s];
+      v[s] = (size_t(i) < errors.size() ? weights[s]*errors[i] : 0.);
+      // contributions clamped to zero by the function do not fluctuate
+      if(!this->_allowNegativeYields && size_t(i) < contents.size() && weights[s]*contents[i] < 0) v[s] = 0.;
+    }
+    double var = 0.;
+    if(sampleCorrelation){
+      const double* rho = sampleCorrelation->GetMatrixArray();
+      for(size_t s=0; s<nsamples; ++s){
+        if(v[s] == 0.) continue;
+        double rv = 0.;
+        for(size_t t=0; t<nsamples; ++t) rv += rho[s*nsamples+t]*v[t];
+        var += v[s]*rv;
+      }
+    } else {
+      for(size_t s=0; s<nsamples; ++s) var += v[s]*v[s];
+    }
+    cov(i,i) = var;
+  }
+  return cov;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+TMatrixD RooLagrangianMorphing::RooLagrangianMorphBase<Base>::createParameterCovarianceMatrix(const RooFitResult* r) const {
+  // retrieve the bin-by-bin covariance of the morphed distribution due to
+  // the uncertainties of the parameters, J C J^T, where C is the covariance
+  // of those floating parameters of the fit result that are parameters of
+  // this function and J the jacobian of the bin contents, obtained from the
+  // analytic derivatives of the polynomials and the template contents
+  // contributions that are clamped to zero (see allowNegativeYields) do not
+  // depend on the parameters and do not enter the jacobian
+  auto cache = this->getCache(_curNormSet);
+  if(!cache->_templatesValid) cache->updateTemplates();
+  const int nbins = this->nBins();
+  TMatrixD cov(nbins,nbins);
+  if(!r) return cov;
+  const RooArgList& floats = r->floatParsFinal();
+  const TMatrixDSym& fitcov = r->covarianceMatrix();
+  std::vector<int> indices;
+  for(int p=0; p<floats.getSize(); ++p){
+    if(this->hasParameter(floats.at(p)->GetName())) indices.push_back(p);
+  }
+  const size_t npars = indices.size();
+  if(npars == 0) return cov;
+  const size_t nsamples = cache->_componentWeights.size();
+  std::vector<double> weights(nsamples);
+  for(size_t s=0; s<nsamples; ++s){
+    weights[s] = cache->_componentWeights[s]->getVal();
+  }
+  // J(i,p) = sum_s dw_s/dtheta_p * T_s(i), with dw/dtheta = Inverse^T * df/dtheta
+  const TMatrixD inverse(makeRootMatrix(cache->_inverse));
+  TMatrixD jacobian(nbins,npars);
+  for(size_t p=0; p<npars; ++p){
+    const std::vector<double> dformulas(this->getFormulaGradient(floats.at(indices[p])->GetName()));
+    for(size_t s=0; s<nsamples && s<size_t(inverse.GetNcols()); ++s){
+      double dweight = 0.;
+      for(int k=0; k<inverse.GetNrows() && size_t(k)<dformulas.size(); ++k){
+        dweight += inverse(k,s) * dformulas[k];
+      }
+      if(dweight == 0.) continue;
+      const std::vector<double>& contents = cache->_templates->contents[s];
+      const size_t n = std::min(contents.size(),size_t(nbins));
+      for(size_t i=0; i<n; ++i){
+        if(!this->_allowNegativeYields && weights[s]*contents[i] < 0) continue;
+        jacobian(i,p) += dweight*contents[i];
+      }
+    }
+  }
+  TMatrixD parcov(npars,npars);
+  for(size_t p=0; p<npars; ++p){
+    for(size_t q=0; q<npars; ++q){
+      parcov(p,q) = fitcov(indices[p],indices[q]);
+    }
+  }
+  const TMatrixD jc(jacobian,TMatrixD::kMult,parcov);
+  cov.MultT(jc,jacobian);
+  return cov;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+TMatrixD RooLagrangianMorphing::RooLagrangianMorphBase<Base>::createCovarianceMatrix(const RooFitResult* r, const TMatrixD* sampleCorrelation) const {
+  // retrieve the full bin-by-bin covariance of the morphed distribution,
+  // the sum of the template statistics and the parameter contributions
+  TMatrixD cov(this->createTemplateCovarianceMatrix(sampleCorrelation));
+  if(r) cov += this->createParameterCovarianceMatrix(r);
+  return cov;
+}
+
 
 //_____________________________________________________________________________
 template <class Base>
@@ -3078,6 +5161,19 @@ void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::printEvaluation() cons
   }
 }
 
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::printPrecisions() const {
+  // print cost and accuracy of all available precisions for the current morphing matrix
+  const std::vector<RooLagrangianMorphing::PrecisionReport> reports(this->comparePrecisions());
+  std::cout << "inversion precision: " << RooLagrangianMorphing::getPrecisionName(RooLagrangianMorphing::gInversionPrecision) << ", evaluation precision: " << RooLagrangianMorphing::getPrecisionName(RooLagrangianMorphing::gEvaluationPrecision) << std::endl;
+  for(const auto& report:reports){
+    std::cout << std::setw(20) << RooLagrangianMorphing::getPrecisionName(report.precision)
+              << " inversion: " << std::setw(12) << report.inversionTime << "s (deviation from unity " << std::setw(12) << report.inversionDeviation << ")"
+              << " evaluation: " << std::setw(12) << report.evaluationTime << "s (relative deviation " << std::setw(12) << report.evaluationDeviation << ")" << std::endl;
+  }
+}
+
 //_____________________________________________________________________________
 template <class Base>
 const RooArgList* RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getParameterSet() const {
@@ -3180,8 +5276,7 @@ Double_t RooLagrangianMorphPdf::expectedEvents(const RooArgSet* nset) const {
 //_____________________________________________________________________________
 Double_t RooLagrangianMorphPdf::expectedEvents() const {
   // return the number of expected events for the current parameter set
-  RooArgSet set;
-  set.add(*this->getObservable());
+  RooArgSet set(this->getObservables());
   return this->getPdf()->expectedEvents(set);
 }
 
@@ -3196,35 +5291,44 @@ Double_t RooLagrangianMorphPdf::expectedEvents(const RooArgSet& nset) const {
 template <class Base>
 double RooLagrangianMorphing::RooLagrangianMorphBase<Base>::expectedUncertainty() const {
   // return the expected uncertainty for the current parameter set
-  RooRealVar* observable = this->getObservable();
+  // the per-sample sums of squared weights are cached, such that this only
+  // requires one evaluation of every sample weight
   auto cache = this->getCache(_curNormSet);
   double unc2 = 0;
-  for(const auto& sample:this->_sampleMap){
-    RooAbsArg* phys = this->_physics.at(sample.second);
-    TString weightName = TString::Format("w_%s_%s",sample.first.c_str(),this->GetName());
-    RooAbsReal* weight = (RooAbsReal*)(cache->_weights.find(weightName.Data()));
-    if(!weight){
-      ERROR("unable to find object "+weightName);
-    }
-    double newunc2 = 0;
-    RooHistFunc* hf = dynamic_cast<RooHistFunc*>(phys);
-    RooRealVar* rv = dynamic_cast<RooRealVar*>(phys);
-    if(hf){
-      const RooDataHist& hist = hf->dataHist();
-      for(Int_t j=0; j<observable->getBins(); ++j){
-        hist.get(j);
-        newunc2 += hist.weightSquared();
-      }
-    } else if(rv){
-      newunc2 = pow(rv->getError(),2);
-    }
-    double w = weight->getVal();
-    unc2 += newunc2*w*w;
-    // std::cout << phys->GetName() << " : " << weight->GetName() << " thisweight: " <<  w << " thisxsec2: " << newunc2 << " weight " << weight << std::endl;
+  for(size_t i=0; i<cache->_componentWeights.size(); ++i){
+    const double w = cache->_componentWeights[i]->getVal();
+    unc2 += cache->getSampleSumW2(i)*w*w;
   }
   return sqrt(unc2);
 }
 
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::expectedUncertainty(const std::vector<ParamSet>& points) {
+  // return the expected uncertainty for many parameter sets at once
+  // the parameters are restored to their previous values afterwards
+  auto cache = this->getCache(_curNormSet);
+  const ParamSet values = this->getParameters();
+  const size_t n = cache->_componentWeights.size();
+  std::vector<double> sumw2(n);
+  for(size_t i=0; i<n; ++i){
+    sumw2[i] = cache->getSampleSumW2(i);
+  }
+  std::vector<double> uncertainties;
+  uncertainties.reserve(points.size());
+  for(const auto& point:points){
+    this->setParameters(point);
+    double unc2 = 0;
+    for(size_t i=0; i<n; ++i){
+      const double w = cache->_componentWeights[i]->getVal();
+      unc2 += sumw2[i]*w*w;
+    }
+    uncertainties.push_back(sqrt(unc2));
+  }
+  this->setParameters(values);
+  return uncertainties;
+}
+
 //_____________________________________________________________________________
 template <class Base>
 void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::printParameters() const {
@@ -3274,12 +5378,15 @@ Double_t RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getValV(const RooA
 {
   //cout << "XX RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getValV(" << this << ") set = " << set << endl ;
   this->_curNormSet = set ;
+  countEvent(&this->_statistics,&RooLagrangianMorphing::Statistics::evaluations);
   return Base::getValV(set) ;
 }
 
 template <class Base>
 Double_t RooLagrangianMorphing::RooLagrangianMorphBase<Base>::evaluate() const {
   // call getVal on the internal function
+  // this is only called by RooFit if the function is dirty
+  countEvent(&this->_statistics,&RooLagrangianMorphing::Statistics::recomputations);
   InternalType* pdf = this->getInternal();
   if(pdf) return pdf->getVal(_curNormSet);
   else ERROR("unable to aquire in-built pdf!");
@@ -3348,12 +5455,274 @@ TMatrixD RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getInvertedMatrix(
 //_____________________________________________________________________________
 template <class Base>
 double RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getCondition() const {
-  // retrieve the condition of the coefficient matrix
+  // retrieve the condition of the coefficient matrix (after equilibration, if enabled)
+  // for block-structured matrices, this is the largest condition of any block
   auto cache = getCache(_curNormSet);
   if(!cache) ERROR("unable to retrieve cache!");
   return cache->_condition;
 }
 
+//_____________________________________________________________________________
+template <class Base>
+double RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getMatrixBuildTime() const {
+  // retrieve the wall time (in seconds) spent filling the morphing matrix at the last build
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  return cache->_buildTime;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+double RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getInversionTime() const {
+  // retrieve the wall time (in seconds) spent inverting the morphing matrix at the last build
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  return cache->_inversionTime;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+const RooLagrangianMorphing::Statistics& RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getStatistics() const {
+  // retrieve the timers and counters of this object
+  // unlike the other getters, this does not build the cache
+  return this->_statistics;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::resetStatistics(){
+  // reset the timers and counters of this object
+  this->_statistics = RooLagrangianMorphing::Statistics();
+}
+
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::writeStatistics(std::ostream& stream) const {
+  // write the timers and counters of this object as a JSON object
+  RooLagrangianMorphing::writeStatistics(this->_statistics,stream);
+}
+
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::fillMemoryReport(RooLagrangianMorphing::MemoryReport& report, std::set<const void*>& seen) const {
+  // book the memory held by this object, without building the cache
+  ++report.instances;
+  RooFIter itr(this->_physics.fwdIterator());
+  RooAbsArg* obj;
+  while((obj = itr.next())){
+    addNodeMemory(obj,report,seen);
+  }
+  RooLagrangianMorphBase<Base>::CacheElem* cache = (RooLagrangianMorphBase<Base>::CacheElem*) _cacheMgr.getObj(0,(RooArgSet*)0);
+  if(cache) cache->fillMemoryReport(report,seen);
+}
+
+//_____________________________________________________________________________
+template <class Base>
+RooLagrangianMorphing::MemoryReport RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getMemoryReport() const {
+  // estimate the memory held by this object, by category
+  // the templates in the physics list, the nodes of the morphing function,
+  // the template table and the morphing matrices are included
+  RooLagrangianMorphing::MemoryReport report;
+  std::set<const void*> seen;
+  this->fillMemoryReport(report,seen);
+  return report;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+void RooLagrangianMorphing::RooLagrangianMorphBase<Base>::printMemoryReport() const {
+  // print the memory held by this object
+  RooLagrangianMorphing::printMemoryReport(this->getMemoryReport());
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<RooLagrangianMorphing::PrecisionReport> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::comparePrecisions(size_t nrep) const {
+  // measure cost and accuracy of all available precisions for the current morphing matrix
+  // the inversion accuracy is the largest deviation of matrix*inverse from unity,
+  // the evaluation accuracy is the largest deviation of the sample weights at the
+  // current parameter point from those obtained in the most precise arithmetic
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  std::vector<RooLagrangianMorphing::PrecisionReport> reports;
+  const size_t n = size(cache->_matrix);
+  if(ncols(cache->_matrix) != n){
+    ERROR("precisions can only be compared for square morphing matrices!");
+    return reports;
+  }
+  const std::vector<double> matrix(flattenMatrix(cache->_matrix));
+  const std::vector<double> formulas(this->getFormulaValues());
+  const RooLagrangianMorphing::Precision precisions[] = {
+    RooLagrangianMorphing::DoublePrecision,
+    RooLagrangianMorphing::LongDoublePrecision,
+    RooLagrangianMorphing::DoubleDoublePrecision,
+    RooLagrangianMorphing::QuadPrecision,
+    RooLagrangianMorphing::MultiPrecision
+  };
+  // the reference is computed in the most precise arithmetic available
+  RooLagrangianMorphing::Precision reference = RooLagrangianMorphing::DoubleDoublePrecision;
+  for(const auto& precision:precisions){
+    if(RooLagrangianMorphing::isPrecisionAvailable(precision)) reference = precision;
+  }
+  std::vector<WideFloat> referenceInverse;
+  if(!invertMatrixPrecisionEquilibrated(matrix,n,reference,referenceInverse)){
+    ERROR("Error: matrix is not invertible!");
+    return reports;
+  }
+  const std::vector<double> referenceWeights(evaluateWeightsPrecision(referenceInverse,formulas,reference));
+  if(nrep < 1) nrep = 1;
+  for(const auto& precision:precisions){
+    if(!RooLagrangianMorphing::isPrecisionAvailable(precision)) continue;
+    RooLagrangianMorphing::PrecisionReport report;
+    report.precision = precision;
+    std::vector<WideFloat> inverse;
+    const auto start = std::chrono::steady_clock::now();
+    if(!invertMatrixPrecisionEquilibrated(matrix,n,precision,inverse)) continue;
+    const auto inverted = std::chrono::steady_clock::now();
+    report.inversionTime = std::chrono::duration<double>(inverted-start).count();
+    report.inversionDeviation = unityDeviationPrecision(matrix,inverse,n);
+    // the evaluation is timed with the reference coefficients, such that
+    // both policies can be judged independently of each other
+    std::vector<double> weights;
+    for(size_t i=0; i<nrep; ++i){
+      weights = evaluateWeightsPrecision(referenceInverse,formulas,precision);
+    }
+    const auto evaluated = std::chrono::steady_clock::now();
+    report.evaluationTime = std::chrono::duration<double>(evaluated-inverted).count() / nrep;
+    report.evaluationDeviation = 0.;
+    for(size_t s=0; s<n; ++s){
+      const double scale = std::max(1.,std::fabs(referenceWeights[s]));
+      report.evaluationDeviation = std::max(report.evaluationDeviation,std::fabs(weights[s]-referenceWeights[s])/scale);
+    }
+    reports.push_back(report);
+  }
+  return reports;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getFormulaValues() const {
+  // retrieve the values of the morphing polynomials for the current parameter set
+  // the order corresponds to the columns of the morphing matrix
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  std::vector<double> values;
+  values.reserve(cache->_formulas.size());
+  for(const auto& formula:cache->_formulas){
+    values.push_back(formula.second->getVal());
+  }
+  return values;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getFormulaGradient(const char* paramname, double epsilon) const {
+  // retrieve the derivatives of the morphing polynomials with respect to the given parameter
+  // the polynomials are products of couplings and are differentiated analytically,
+  // epsilon is only used for couplings that are formulas of the parameter
+  RooRealVar* param = this->getParameter(paramname);
+  if(!param){
+    ERROR("unable to find parameter '" << paramname << "'!");
+    return std::vector<double>();
+  }
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  std::map<RooAbsReal*,double> derivatives;
+  std::vector<double> gradient;
+  gradient.reserve(cache->_formulas.size());
+  for(const auto& formula:cache->_formulas){
+    gradient.push_back(formulaDerivative(formula.second,param,epsilon,derivatives));
+  }
+  return gradient;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getWeightValues() const {
+  // retrieve the values of the sample weights for the current parameter set
+  // the order corresponds to the rows of the morphing matrix
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  std::vector<double> values;
+  values.reserve(cache->_weights.getSize());
+  RooFIter itr(cache->_weights.fwdIterator());
+  RooAbsArg* obj;
+  while((obj = itr.next())){
+    values.push_back(static_cast<RooAbsReal*>(obj)->getVal());
+  }
+  return values;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getWeightGradient(const char* paramname, double epsilon) const {
+  // retrieve the derivatives of the sample weights with respect to the given parameter
+  // as the weights are linear in the polynomials, this is simply Inverse^T * dPolynomials
+  auto cache = getCache(_curNormSet);
+  if(!cache) ERROR("unable to retrieve cache!");
+  const std::vector<double> dformulas(this->getFormulaGradient(paramname,epsilon));
+  const TMatrixD inverse(makeRootMatrix(cache->_inverse));
+  std::vector<double> gradient(inverse.GetNcols(),0.);
+  for(int s=0; s<inverse.GetNcols(); ++s){
+    for(int k=0; k<inverse.GetNrows(); ++k){
+      gradient[s] += inverse(k,s) * dformulas[k];
+    }
+  }
+  return gradient;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getSampleYields() const {
+  // retrieve the total yield of every input sample
+  // the order corresponds to the rows of the morphing matrix
+  auto cache = this->getCache(_curNormSet);
+  std::vector<double> yields(cache->_componentPhysics.size());
+  for(size_t i=0; i<yields.size(); ++i){
+    yields[i] = cache->getSampleYield(i);
+  }
+  return yields;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<double> RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getSampleSumW2() const {
+  // retrieve the total sum of squared weights of every input sample
+  // the order corresponds to the rows of the morphing matrix
+  auto cache = this->getCache(_curNormSet);
+  std::vector<double> sumw2(cache->_componentPhysics.size());
+  for(size_t i=0; i<sumw2.size(); ++i){
+    sumw2[i] = cache->getSampleSumW2(i);
+  }
+  return sumw2;
+}
+
+
+//_____________________________________________________________________________
+template <class Base>
+std::vector<std::vector<double> > RooLagrangianMorphing::RooLagrangianMorphBase<Base>::getSampleTemplates(bool errors) const {
+  // retrieve the bin contents (or errors) of the template of every input sample
+  // the order corresponds to the rows of the morphing matrix, samples
+  // that are not histograms are represented by a single bin
+  auto cache = this->getCache(_curNormSet);
+  if(!cache->_templatesValid) cache->updateTemplates();
+  std::vector<std::vector<double> > templates;
+  for(size_t i=0; i<cache->_componentPhysics.size(); ++i){
+    if(!cache->_templates->contents[i].empty()){
+      templates.push_back(errors ? cache->_templates->errors[i] : cache->_templates->contents[i]);
+    } else {
+      templates.push_back(std::vector<double>(1,errors ? sqrt(cache->getSampleSumW2(i)) : cache->getSampleYield(i)));
+    }
+  }
+  return templates;
+}
+
+//_____________________________________________________________________________
+template <class Base>
+bool RooLagrangianMorphing::RooLagrangianMorphBase<Base>::allowsNegativeYields() const {
+  // return false if every morphed component is clamped at zero, true otherwise
+  return this->_allowNegativeYields;
+}
 
 template class RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsReal>;
 template class RooLagrangianMorphing::RooLagrangianMorphBase<RooAbsPdf>;
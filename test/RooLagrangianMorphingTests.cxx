@@ -0,0 +1,410 @@
+#include <RooLagrangianMorphing/RooLagrangianMorphing.h>
+#include <RooLagrangianMorphing/LinearCombination.h>
+#include <RooLagrangianMorphing/RooLagrangianMorphInputGenerator.h>
+
+#include <RooRealVar.h>
+#include <RooStringVar.h>
+#include <RooArgList.h>
+#include <RooArgSet.h>
+#include <RooMsgService.h>
+#include <RooDataHist.h>
+#include <RooGlobalFunc.h>
+
+#include <TDirectory.h>
+#include <TFile.h>
+#include <TFolder.h>
+#include <TH1.h>
+#include <TMatrixD.h>
+#include <TSystem.h>
+#include <TString.h>
+
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// usage: RooLagrangianMorphingTests <test>
+// small closure tests of the numerical machinery on synthetic inputs,
+// every test is run by one of the scripts in test/ and returns 0 on success
+
+namespace {
+  typedef RooLagrangianMorphing::ParamSet ParamSet;
+  typedef RooLagrangianMorphing::ParamMap ParamMap;
+  const char* const obsName = "observable";
+
+#define CHECK(cond,arg){                                                \
+    if(!(cond)){ std::cerr << "FAILED: " << arg << std::endl; return false; } \
+    else { std::cout << "passed: " << arg << std::endl; }}
+
+  //_____________________________________________________________________________
+
+  class Inputs {
+    // synthetic samples of one process, kept in memory as input folders
+  public:
+    RooArgList prod;
+    RooArgList dec;
+    RooLagrangianMorphInputGenerator generator;
+    std::map<std::string,TFolder*> folders;
+
+    Inputs(const RooArgList& p, const RooArgList& d, int nbins, unsigned long long seed = 12345) :
+      prod(p), dec(d), generator(p,d,nbins,seed) {}
+    ~Inputs(){
+      for(auto& folder:this->folders){
+        gDirectory->Remove(folder.second);
+        delete folder.second;
+      }
+    }
+
+    void addSamples(const ParamMap& samples, RooArgList& names){
+      // create the input folders of the given samples and list their names
+      for(const auto& sample:samples){
+        if(this->folders.find(sample.first) == this->folders.end()){
+          TFolder* folder = this->generator.makeSampleFolder(sample.first,sample.second,obsName);
+          gDirectory->Add(folder);
+          this->folders[sample.first] = folder;
+        }
+        names.addOwned(*(new RooStringVar(sample.first.c_str(),sample.first.c_str(),sample.first.c_str())));
+      }
+    }
+
+    RooLagrangianMorphFunc* morph(const char* name, const ParamMap& samples, const std::vector<std::vector<const char*> >& nonInterfering = std::vector<std::vector<const char*> >()){
+      // create a morphing function from the given samples
+      RooArgList names;
+      this->addSamples(samples,names);
+      return new RooLagrangianMorphFunc(name,name,"",obsName,this->prod,this->dec,nonInterfering,names);
+    }
+
+    double closure(RooLagrangianMorphFunc* func, const ParamSet& point){
+      // largest relative deviation of the morphed template from the truth
+      func->setParameters(point);
+      TH1* hist = func->createTH1("closure");
+      const std::vector<double> truth(this->generator.truth(point));
+      double deviation = 0.;
+      for(size_t b=0; b<truth.size(); ++b){
+        if(truth[b] != 0) deviation = std::max(deviation,std::fabs(hist->GetBinContent(b+1)/truth[b]-1.));
+      }
+      delete hist;
+      return deviation;
+    }
+  };
+
+  class GenericModel {
+    // one SM and two BSM couplings at the production vertex, the SM coupling at the decay vertex
+  public:
+    RooRealVar kSM;
+    RooRealVar k1;
+    RooRealVar k2;
+    RooArgList prod;
+    RooArgList dec;
+    GenericModel() : kSM("kSM","kSM",1.,0.,2.), k1("k1","k1",0.,-2.,2.), k2("k2","k2",0.,-2.,2.) {
+      this->prod.add(RooArgList(this->kSM,this->k1,this->k2));
+      this->dec.add(this->kSM);
+    }
+  };
+
+  double matrixDeviation(const TMatrixD& a, const TMatrixD& b){
+    // largest absolute difference of two matrices
+    if(a.GetNrows() != b.GetNrows() || a.GetNcols() != b.GetNcols()) return std::numeric_limits<double>::infinity();
+    double deviation = 0.;
+    for(int i=0; i<a.GetNrows(); ++i){
+      for(int j=0; j<a.GetNcols(); ++j){
+        deviation = std::max(deviation,std::fabs(a(i,j)-b(i,j)));
+      }
+    }
+    return deviation;
+  }
+
+  double unityDeviation(const TMatrixD& product){
+    // largest deviation of a square matrix from unity
+    TMatrixD unity(TMatrixD::kUnit,product);
+    return matrixDeviation(product,unity);
+  }
+
+  //_____________________________________________________________________________
+
+  bool testSummation(){
+    // the compensated double-double weight sum has to survive cancellations
+    // that wipe out the plain double sum, and agree with the multiprecision sum
+    RooArgList vars;
+    RooLagrangianMorphing::LinearCombination exact("exact");
+    const double cancelling[] = {1e16, 1., -1e16, 1.};
+    for(size_t i=0; i<4; ++i){
+      RooRealVar* x = new RooRealVar(TString::Format("x%d",int(i)),"x",1.);
+      vars.addOwned(*x);
+      exact.add(RooLagrangianMorphing::SuperFloat(cancelling[i]),x);
+    }
+    RooLagrangianMorphing::gEvaluationPrecision = RooLagrangianMorphing::DoubleDoublePrecision;
+    const double compensated = exact.evaluate();
+    RooLagrangianMorphing::gEvaluationPrecision = RooLagrangianMorphing::DefaultPrecision;
+    CHECK(compensated == 2.,"compensated sum of cancelling terms is " << compensated << ", expected 2");
+
+    // random terms of alternating sign spanning many orders of magnitude
+    std::mt19937_64 engine(42);
+    std::uniform_real_distribution<double> uniform(-1.,1.);
+    RooLagrangianMorphing::LinearCombination random("random");
+    std::vector<double> coefficients;
+    std::vector<double> values;
+    double magnitude = 0.;
+    for(size_t i=0; i<1000; ++i){
+      coefficients.push_back(uniform(engine) * std::pow(10.,int(i%16)));
+      values.push_back(uniform(engine));
+      RooRealVar* y = new RooRealVar(TString::Format("y%d",int(i)),"y",values.back());
+      vars.addOwned(*y);
+      random.add(RooLagrangianMorphing::SuperFloat(coefficients.back()),y);
+      magnitude += std::fabs(coefficients.back() * values.back());
+    }
+    RooLagrangianMorphing::gEvaluationPrecision = RooLagrangianMorphing::DoubleDoublePrecision;
+    const double dd = random.evaluate();
+    RooLagrangianMorphing::gEvaluationPrecision = RooLagrangianMorphing::DefaultPrecision;
+#ifdef USE_UBLAS
+    // the default precision of the boost build is the multiprecision sum
+    const double reference = random.evaluate();
+#else
+    long double sum = 0.;
+    for(size_t i=0; i<coefficients.size(); ++i) sum += (long double)(coefficients[i]) * values[i];
+    const double reference = (double)(sum);
+#endif
+    CHECK(std::fabs(dd-reference) <= 1e-15*magnitude,"double-double sum " << dd << " agrees with the reference sum " << reference);
+    return true;
+  }
+
+  //_____________________________________________________________________________
+
+  bool testCondition(){
+    // rescaling the rows of a well-conditioned matrix must not change the
+    // equilibrated condition, while the raw condition explodes
+    const std::vector<double> matrix = {1e-8, 2e-8, 3., 4.};
+    const bool equilibrate = RooLagrangianMorphing::gEquilibrate;
+    RooLagrangianMorphing::gEquilibrate = false;
+    const double raw = RooLagrangianMorphing::estimateCondition(matrix,2);
+    RooLagrangianMorphing::gEquilibrate = true;
+    double logdet = 0.;
+    const double equilibrated = RooLagrangianMorphing::estimateCondition(matrix,2,&logdet);
+    std::vector<double> inverse;
+    double deviation = 1.;
+    const bool inverted = RooLagrangianMorphing::invertFlatMatrix(matrix,2,inverse,&deviation);
+    RooLagrangianMorphing::gEquilibrate = equilibrate;
+    CHECK(raw > 1e6,"raw condition " << raw << " reflects the row scaling");
+    CHECK(equilibrated < 100.,"equilibrated condition " << equilibrated << " is that of the unscaled matrix");
+    CHECK(std::fabs(logdet-std::log(2e-8)) < 1e-10,"log|det| " << logdet << " includes the scale factors");
+    CHECK(inverted && deviation < 1e-12,"equilibrated inverse deviates from unity by " << deviation);
+    return true;
+  }
+
+  //_____________________________________________________________________________
+
+  bool testBlocks(){
+    // non-interfering couplings give a block-diagonal morphing matrix, whose
+    // blocks are inverted separately and report their own condition
+    RooRealVar kA("kA","kA",0.,-200.,200.);
+    RooRealVar kB("kB","kB",0.,-200.,200.);
+    RooRealVar kC("kC","kC",0.,-200.,200.);
+    RooRealVar kD("kD","kD",1.,0.,2.);
+    Inputs inputs(RooArgList(kA,kB,kC),RooArgList(kD),10);
+    ParamMap samples;
+    samples["s0"] = {{"kA",1.},{"kB",0.},{"kC",0.},{"kD",1.}};
+    samples["s1"] = {{"kA",0.},{"kB",10.},{"kC",0.},{"kD",1.}};
+    samples["s2"] = {{"kA",0.},{"kB",0.},{"kC",100.},{"kD",1.}};
+    const bool equilibrate = RooLagrangianMorphing::gEquilibrate;
+    RooLagrangianMorphing::gEquilibrate = false;
+    RooLagrangianMorphFunc* func = inputs.morph("blocks",samples,{{"kA","kB","kC"}});
+    func->getVal();
+    const TMatrixD matrix(func->getMatrix());
+    const TMatrixD inverse(func->getInvertedMatrix());
+    const double condition = func->getCondition();
+    const double full = RooLagrangianMorphing::estimateCondition(matrix);
+    RooLagrangianMorphing::gEquilibrate = equilibrate;
+    bool outside = true;
+    for(int i=0; i<inverse.GetNrows(); ++i){
+      for(int j=0; j<inverse.GetNcols(); ++j){
+        if(matrix(j,i) == 0. && inverse(i,j) != 0.) outside = false;
+      }
+    }
+    const double deviation = unityDeviation(inverse*matrix);
+    delete func;
+    CHECK(matrix.GetNrows() == 3 && matrix.GetNcols() == 3,"interference terms are removed from the matrix");
+    CHECK(full > 1e3,"condition of the full matrix is " << full);
+    CHECK(condition < 1.5,"largest block condition is " << condition);
+    CHECK(outside,"inverse vanishes outside the blocks");
+    CHECK(deviation < 1e-12,"inverse deviates from unity by " << deviation);
+    return true;
+  }
+
+  //_____________________________________________________________________________
+
+  bool testLeastSquares(){
+    // with more samples than polynomials, the least-squares morphing has to
+    // reproduce the (polynomial) truth at points outside the samples
+    GenericModel model;
+    Inputs inputs(model.prod,model.dec,10);
+    inputs.generator.setRange("kSM",0.5,1.5);
+    const size_t nformulas = inputs.generator.nSamples();
+    const ParamMap samples(inputs.generator.generateParamCards(2*nformulas));
+    const bool leastSquares = RooLagrangianMorphing::gLeastSquares;
+    RooLagrangianMorphing::gLeastSquares = true;
+    RooLagrangianMorphFunc* func = inputs.morph("lsq",samples);
+    func->getVal();
+    RooLagrangianMorphing::gLeastSquares = leastSquares;
+    const TMatrixD matrix(func->getMatrix());
+    double closure = 0.;
+    for(const auto& point:inputs.generator.generateParamCards(5,"p")){
+      closure = std::max(closure,inputs.closure(func,point.second));
+    }
+    delete func;
+    CHECK(size_t(matrix.GetNrows()) == 2*nformulas && size_t(matrix.GetNcols()) == nformulas,"matrix is " << matrix.GetNrows() << "x" << matrix.GetNcols());
+    CHECK(closure < 1e-6,"least-squares closure is " << closure);
+    return true;
+  }
+
+  //_____________________________________________________________________________
+
+  bool testSelection(){
+    // a pool dominated by nearly identical samples, the selection has to
+    // find a subset that is much better conditioned than the first samples
+    GenericModel model;
+    Inputs inputs(model.prod,model.dec,10);
+    inputs.generator.setRange("kSM",0.5,1.5);
+    const size_t nformulas = inputs.generator.nSamples();
+    ParamMap pool(inputs.generator.generateParamCards(2*nformulas,"b"));
+    std::mt19937_64 engine(42);
+    std::uniform_real_distribution<double> jitter(-1e-3,1e-3);
+    for(size_t i=0; i<3*nformulas; ++i){
+      pool[TString::Format("a%03d",int(i)).Data()] = {{"kSM",1.+jitter(engine)},{"k1",0.5+jitter(engine)},{"k2",0.5+jitter(engine)}};
+    }
+    ParamMap first;
+    for(const auto& sample:pool){
+      if(first.size() == nformulas) break;
+      first.insert(sample);
+    }
+    RooArgList couplings;
+    couplings.add(model.prod);
+    std::vector<RooArgList*> vertices = {&model.prod,&model.dec};
+    const std::vector<std::string> names(RooLagrangianMorphing::selectSamples(pool,vertices,couplings));
+    CHECK(names.size() == nformulas,"selected " << names.size() << " of " << nformulas << " samples");
+    ParamMap selected;
+    for(const auto& name:names) selected[name] = pool.at(name);
+    RooLagrangianMorphFunc* naive = inputs.morph("naive",first);
+    RooLagrangianMorphFunc* best = inputs.morph("best",selected);
+    const double naiveCondition = naive->getCondition();
+    const double bestCondition = best->getCondition();
+    const double closure = inputs.closure(best,inputs.generator.generateParamCards(1,"p").begin()->second);
+    delete naive;
+    delete best;
+    CHECK(bestCondition*1e3 < naiveCondition,"selected condition " << bestCondition << ", first samples " << naiveCondition);
+    CHECK(closure < 1e-6,"closure of the selected samples is " << closure);
+    return true;
+  }
+
+  //_____________________________________________________________________________
+
+  bool testPersistence(){
+    // a clone and a copy read back from a file have to reuse the inverse
+    // of the original instead of inverting the matrix again
+    GenericModel model;
+    Inputs inputs(model.prod,model.dec,10);
+    inputs.generator.setRange("kSM",0.5,1.5);
+    const ParamMap samples(inputs.generator.generateParamCards());
+    RooLagrangianMorphFunc* func = inputs.morph("persisted",samples);
+    func->getVal();
+    const TMatrixD inverse(func->getInvertedMatrix());
+    RooLagrangianMorphFunc clone(*func,"clone");
+    clone.getVal();
+    const unsigned long long cloneInversions = clone.getStatistics().phaseCalls[RooLagrangianMorphing::InversionPhase];
+    const double cloneDeviation = matrixDeviation(clone.getInvertedMatrix(),inverse);
+
+    TString filename("RooLagrangianMorphingTests");
+    FILE* tmp = gSystem->TempFileName(filename);
+    if(tmp) fclose(tmp);
+    TDirectory* current = gDirectory;
+    TFile* out = TFile::Open(filename,"RECREATE");
+    out->WriteTObject(func);
+    out->Close();
+    delete out;
+    current->cd();
+    TFile* in = TFile::Open(filename,"READ");
+    RooLagrangianMorphFunc* restored = dynamic_cast<RooLagrangianMorphFunc*>(in->Get(func->GetName()));
+    current->cd();
+    if(!restored){
+      std::cerr << "FAILED: unable to read back the morphing function" << std::endl;
+      return false;
+    }
+    const ParamSet point(inputs.generator.generateParamCards(1,"p").begin()->second);
+    func->setParameters(point);
+    restored->setParameters(point);
+    const double value = func->getVal();
+    const double restoredValue = restored->getVal();
+    const unsigned long long inversions = restored->getStatistics().phaseCalls[RooLagrangianMorphing::InversionPhase];
+    const double deviation = matrixDeviation(restored->getInvertedMatrix(),inverse);
+    delete restored;
+    in->Close();
+    delete in;
+    gSystem->Unlink(filename);
+    delete func;
+    CHECK(cloneInversions == 0,"clone inverted the matrix " << cloneInversions << " times");
+    CHECK(cloneDeviation == 0.,"clone inverse deviates by " << cloneDeviation);
+    CHECK(inversions == 0,"restored function inverted the matrix " << inversions << " times");
+    CHECK(deviation == 0.,"restored inverse deviates by " << deviation);
+    CHECK(std::fabs(restoredValue-value) <= 1e-12*std::fabs(value),"restored value " << restoredValue << ", original " << value);
+    return true;
+  }
+  //_____________________________________________________________________________
+
+  bool testEngineClone(){
+    // a fit clones the pdf together with its couplings, the clone must not
+    // use the weights of the shared engine, which follow the original couplings
+    GenericModel model;
+    model.kSM.setConstant(true);
+    model.k2.setConstant(true);
+    Inputs inputs(model.prod,model.dec,10);
+    inputs.generator.setRange("kSM",0.5,1.5);
+    inputs.generator.setNormalization(1e4);
+    const ParamMap samples(inputs.generator.generateParamCards());
+    RooArgList names;
+    inputs.addSamples(samples,names);
+    RooLagrangianMorphPdf pdf("engine","engine","",obsName,model.prod,model.dec,names);
+    pdf.getWeightEngine();
+    const ParamSet target = {{"kSM",1.},{"k1",0.7},{"k2",0.}};
+    TH1* hist = inputs.generator.createTruthTH1(target,"data");
+    RooDataHist data("data","data",RooArgList(*pdf.getObservable()),hist);
+    delete hist;
+    model.kSM.setVal(1.);
+    model.k1.setVal(0.);
+    model.k2.setVal(0.);
+    const double before = pdf.expectedEvents(RooArgSet(*pdf.getObservable()));
+    pdf.fitTo(data,RooFit::Extended(true),RooFit::PrintLevel(-1));
+    const double after = pdf.expectedEvents(RooArgSet(*pdf.getObservable()));
+    CHECK(std::fabs(after-before) > 1e-3*std::fabs(before),"fitted yield " << after << ", initial yield " << before);
+    CHECK(std::fabs(model.k1.getVal()-0.7) < 1e-2,"fitted k1 is " << model.k1.getVal() << ", expected 0.7");
+    return true;
+  }
+}
+
+int main(int argc, char** argv){
+  RooMsgService::instance().setGlobalKillBelow(RooFit::WARNING);
+  const std::map<std::string,std::function<bool()> > tests = {
+    {"summation",testSummation},
+    {"condition",testCondition},
+    {"blocks",testBlocks},
+    {"leastsquares",testLeastSquares},
+    {"selection",testSelection},
+    {"persistence",testPersistence},
+    {"engineclone",testEngineClone}
+  };
+  if(argc < 2 || tests.find(argv[1]) == tests.end()){
+    std::cerr << "usage: " << argv[0] << " <test>, available tests:";
+    for(const auto& test:tests) std::cerr << " " << test.first;
+    std::cerr << std::endl;
+    return 2;
+  }
+  try {
+    return tests.at(argv[1])() ? 0 : 1;
+  } catch (const std::exception& e){
+    std::cerr << "FAILED: " << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the separate inversion of a block-diagonal morphing matrix
+# usage: blockInversion.sh <path to RooLagrangianMorphingTests>
+exec "$1" blocks
@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the compensated double-double weight sum against the multiprecision sum
+# usage: compensatedSummation.sh <path to RooLagrangianMorphingTests>
+exec "$1" summation
@@ -0,0 +1,4 @@
+#!/bin/bash
+# test that a fit through a clone of a function with a shared weight engine moves the morphed yield
+# usage: engineCloneFit.sh <path to RooLagrangianMorphingTests>
+exec "$1" engineclone
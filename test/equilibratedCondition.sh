@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the condition estimate of a row-scaled matrix with and without equilibration
+# usage: equilibratedCondition.sh <path to RooLagrangianMorphingTests>
+exec "$1" condition
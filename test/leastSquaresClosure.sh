@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the closure of least-squares morphing with more samples than polynomials
+# usage: leastSquaresClosure.sh <path to RooLagrangianMorphingTests>
+exec "$1" leastsquares
@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the reuse of the inverse by clones and by a copy read back from a file
+# usage: persistedInverse.sh <path to RooLagrangianMorphingTests>
+exec "$1" persistence
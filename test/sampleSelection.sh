@@ -0,0 +1,4 @@
+#!/bin/bash
+# test the selection of a well-conditioned subset of a sample pool
+# usage: sampleSelection.sh <path to RooLagrangianMorphingTests>
+exec "$1" selection
@@ -0,0 +1,297 @@
+#include <RooLagrangianMorphing/RooLagrangianMorphing.h>
+#include <RooLagrangianMorphing/RooLagrangianMorphOptimizer.h>
+#include <RooLagrangianMorphing/RooLagrangianMorphInputGenerator.h>
+
+#include <RooRealVar.h>
+#include <RooStringVar.h>
+#include <RooArgList.h>
+#include <RooArgSet.h>
+#include <RooMsgService.h>
+
+#include <TDirectory.h>
+#include <TFolder.h>
+#include <TH1.h>
+#include <TSystem.h>
+#include <TString.h>
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// usage: RooLagrangianMorphingBenchmark [output.json] [nevaluations]
+// builds synthetic in-memory inputs for a range of models and input sizes,
+// times the individual stages of the morphing and writes the results as JSON
+
+namespace {
+  typedef RooLagrangianMorphing::ParamSet ParamSet;
+  typedef RooLagrangianMorphing::ParamMap ParamMap;
+
+  class Config {
+  public:
+    std::string model;
+    int ncouplings;
+    int nbins;
+    Config(const std::string& m, int nc, int nb) : model(m), ncouplings(nc), nbins(nb) {}
+  };
+
+  class Model {
+  public:
+    RooArgList owned;
+    RooArgSet operators;
+    RooArgSet prodCouplings;
+    RooArgSet decCouplings;
+    std::vector<std::string> active;
+    ParamSet fixed;
+  };
+
+  class Chi2Evaluator : public RooLagrangianMorphOptimizer::Evaluator {
+  public:
+    virtual double operator() (double val_morphed, double unc_morphed, double val_benchmark, double unc_benchmark) override {
+      const double unc2 = unc_morphed*unc_morphed + unc_benchmark*unc_benchmark;
+      return unc2 > 0 ? pow(val_morphed-val_benchmark,2)/unc2 : 0.;
+    }
+  };
+
+  //_____________________________________________________________________________
+
+  void makeModel(const Config& config, Model& model){
+    // create the operators and couplings of a model
+    // only the first ncouplings operators are active, all others are kept at zero
+    if(config.model == "HCggfZZ"){
+      // Higgs Characterisation ggF production with H->ZZ decay, CP-even couplings only
+      RooArgSet prod(RooLagrangianMorphing::makeHCggFCouplings(model.operators));
+      RooArgSet dec(RooLagrangianMorphing::makeHCHZZCouplings(model.operators));
+      model.prodCouplings.add(*prod.find("_gHgg"));
+      model.active.push_back("kHgg");
+      const char* couplings[] = {"_gSM","_gHzz","_gHdz","_gHaa","_gHza","_gHda"};
+      const char* kappas[] = {"kSM","kHzz","kHdz","kHaa","kHza","kHda"};
+      for(int i=0; i<std::min(config.ncouplings,6); ++i){
+        model.decCouplings.add(*dec.find(couplings[i]));
+        model.active.push_back(kappas[i]);
+      }
+      model.fixed["cosa"] = 1.;
+      model.fixed["Lambda"] = 1000.;
+      model.owned.addOwned(prod);
+      model.owned.addOwned(dec);
+    } else if(config.model == "SMEFTggfWW"){
+      // SMEFT ggF production with H->WW decay, with an explicit SM contribution
+      RooRealVar* sm = new RooRealVar("kSM","kSM",1.);
+      model.operators.add(*sm);
+      model.prodCouplings.add(*sm);
+      model.decCouplings.add(*sm);
+      RooArgSet prod(RooLagrangianMorphing::makeSMEFTggFCouplings(model.operators));
+      RooArgSet dec(RooLagrangianMorphing::makeSMEFTHWWCouplings(model.operators));
+      model.prodCouplings.add(prod);
+      model.decCouplings.add(dec);
+      model.active.push_back("kSM");
+      model.active.push_back("kHG");
+      model.active.push_back("kHW");
+      model.fixed["Lambda"] = 1000.;
+      model.owned.addOwned(prod);
+      model.owned.addOwned(dec);
+    } else {
+      // generic model with one SM and ncouplings BSM couplings at the production vertex
+      RooRealVar* sm = new RooRealVar("kSM","kSM",1.);
+      model.operators.add(*sm);
+      model.prodCouplings.add(*sm);
+      model.decCouplings.add(*sm);
+      model.active.push_back("kSM");
+      for(int i=0; i<config.ncouplings; ++i){
+        TString name(TString::Format("k%d",i+1));
+        RooRealVar* k = new RooRealVar(name,name,0.);
+        k->setAttribute("NP");
+        model.operators.add(*k);
+        model.prodCouplings.add(*k);
+        model.active.push_back(name.Data());
+      }
+    }
+    // the operator set is filled by the library helpers with plain add(), so it
+    // cannot own its contents; all operators and couplings are owned by a separate
+    // list instead, which is declared first and hence deleted last
+    model.owned.addOwned(model.operators);
+  }
+
+  //_____________________________________________________________________________
+
+  double timeit(const std::function<void()>& f, int n = 1){
+    // measure the average wall time (in seconds) of a function call
+    const auto start = std::chrono::steady_clock::now();
+    for(int i=0; i<n; ++i) f();
+    const auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop-start).count()/n;
+  }
+
+  void writeValue(std::ostream& out, double value){
+    // JSON has no representation of NaN, failed measurements are written as null
+    if(std::isfinite(value)) out << value;
+    else out << "null";
+  }
+
+  //_____________________________________________________________________________
+
+  void runBenchmark(const Config& config, int nevaluations, std::ostream& json){
+    // time all stages of the morphing for one configuration
+    const double NaN = std::numeric_limits<double>::quiet_NaN();
+    const std::string obsname("observable");
+    Model model;
+    makeModel(config,model);
+    std::vector<RooArgList*> vertices;
+    RooArgList prodList(model.prodCouplings);
+    RooArgList decList(model.decCouplings);
+    vertices.push_back(&prodList);
+    vertices.push_back(&decList);
+
+    double tPattern = NaN, tConstruction = NaN, tFirst = NaN, tFill = NaN, tInversion = NaN;
+    double tEvaluation = NaN, tTH1 = NaN, tUncertainty = NaN, tOptimizer = NaN, condition = NaN, closure = NaN;
+
+    int nsamples = 0;
+    tPattern = timeit([&](){ nsamples = RooLagrangianMorphing::countSamples(vertices); });
+
+    // create the synthetic inputs in memory
+    // active operators are drawn at random, all others are kept at zero or their fixed values
+    RooLagrangianMorphInputGenerator generator(vertices,config.nbins,12345);
+    RooFIter opitr(generator.getOperators().fwdIterator());
+    RooAbsArg* op;
+    while((op = opitr.next())){
+      const std::string name(op->GetName());
+      if(std::find(model.active.begin(),model.active.end(),name) != model.active.end()){
+        if(name == "kSM") generator.setRange(name.c_str(),0.5,1.5);
+        else generator.setRange(name.c_str(),-2.,2.);
+      } else {
+        auto fixed = model.fixed.find(name);
+        generator.fixParameter(name.c_str(),fixed == model.fixed.end() ? 0. : fixed->second);
+      }
+    }
+    const ParamMap samples(generator.generateParamCards(nsamples));
+    std::vector<std::string> names;
+    std::vector<TFolder*> folders;
+    RooArgList inputs;
+    for(const auto& sample:samples){
+      names.push_back(sample.first);
+      folders.push_back(generator.makeSampleFolder(sample.first,sample.second,obsname.c_str()));
+      gDirectory->Add(folders.back());
+      inputs.addOwned(*(new RooStringVar(sample.first.c_str(),sample.first.c_str(),sample.first.c_str())));
+    }
+    std::vector<ParamSet> points;
+    for(const auto& p:generator.generateParamCards(nevaluations,"p")) points.push_back(p.second);
+
+    RooLagrangianMorphFunc* func = NULL;
+    try {
+      tConstruction = timeit([&](){ func = new RooLagrangianMorphFunc("bench","bench","",obsname.c_str(),model.prodCouplings,model.decCouplings,inputs); });
+      tFirst = timeit([&](){ func->getVal(); });
+      tFill = func->getMatrixBuildTime();
+      tInversion = func->getInversionTime();
+      condition = func->getCondition();
+      size_t ipoint = 0;
+      tEvaluation = timeit([&](){ func->setParameters(points[ipoint++]); func->getVal(); },nevaluations);
+      tTH1 = timeit([&](){ delete func->createTH1("bench_th1"); });
+      tUncertainty = timeit([&](){ func->expectedUncertainty(); });
+      // the truth is a polynomial of the couplings, so the morphing should close up to rounding
+      closure = 0.;
+      for(size_t i=0; i<std::min(points.size(),size_t(10)); ++i){
+        func->setParameters(points[i]);
+        TH1* hist = func->createTH1("bench_closure");
+        const std::vector<double> truth(generator.truth(points[i]));
+        for(size_t b=0; b<truth.size(); ++b){
+          if(truth[b] != 0) closure = std::max(closure,fabs(hist->GetBinContent(b+1)/truth[b]-1.));
+        }
+        delete hist;
+      }
+    } catch (const std::exception& e){
+      std::cerr << "benchmark " << config.model << " failed: " << e.what() << std::endl;
+    }
+    delete func;
+    for(auto folder:folders){
+      gDirectory->Remove(folder);
+    }
+
+    // the optimizer reads its inputs from a file, use the same samples as benchmarks
+    TString filename("RooLagrangianMorphingBenchmark");
+    FILE* tmp = gSystem->TempFileName(filename);
+    if(tmp) fclose(tmp);
+    try {
+      generator.write(filename.Data(),samples,obsname.c_str());
+      std::vector<RooArgList> optvertices;
+      optvertices.push_back(prodList);
+      optvertices.push_back(decList);
+      const std::string path(TString::Format("%s:%s",filename.Data(),obsname.c_str()).Data());
+      RooLagrangianMorphOptimizer optimizer(path.c_str(),path.c_str(),optvertices,names,TH1::Class(),RooLagrangianMorphOptimizer::ParamCardSet());
+      Chi2Evaluator evaluator;
+      optimizer.setEvaluator(&evaluator);
+      RooLagrangianMorphOptimizer::ParamCardSet pcset;
+      int isample = 0;
+      for(const auto& sample:samples){
+        pcset[TString::Format("sample%03d",isample++).Data()] = sample.second;
+      }
+      tOptimizer = timeit([&](){ optimizer.evaluate(pcset); });
+    } catch (const std::exception& e){
+      std::cerr << "optimizer benchmark " << config.model << " failed: " << e.what() << std::endl;
+    }
+    gSystem->Unlink(filename);
+    for(auto folder:folders) delete folder;
+
+    json << "    {\"model\": \"" << config.model << "\", \"couplings\": " << model.active.size()
+         << ", \"samples\": " << nsamples << ", \"bins\": " << config.nbins << ", \"condition\": ";
+    writeValue(json,condition);
+    json << ", \"closure\": ";
+    writeValue(json,closure);
+    json << ",\n     \"timings\": {";
+    const std::vector<std::pair<const char*,double> > timings = {
+      {"pattern",tPattern},{"construction",tConstruction},{"first_evaluation",tFirst},
+      {"matrix_fill",tFill},{"inversion",tInversion},{"evaluation",tEvaluation},
+      {"createTH1",tTH1},{"expectedUncertainty",tUncertainty},{"optimizer_iteration",tOptimizer}
+    };
+    for(size_t i=0; i<timings.size(); ++i){
+      json << (i==0 ? "" : ", ") << "\"" << timings[i].first << "\": ";
+      writeValue(json,timings[i].second);
+    }
+    json << "}}";
+  }
+}
+
+int main(int argc, char** argv){
+  const std::string outfile(argc > 1 ? argv[1] : "");
+  const int nevaluations = argc > 2 ? atoi(argv[2]) : 100;
+  RooMsgService::instance().setGlobalKillBelow(RooFit::WARNING);
+
+  std::vector<Config> configs;
+  for(int nbins:{10,100,1000}){
+    configs.push_back(Config("HCggfZZ",3,nbins));
+    configs.push_back(Config("SMEFTggfWW",2,nbins));
+  }
+  configs.push_back(Config("HCggfZZ",6,100));
+  for(int ncouplings:{1,2,4,8}){
+    configs.push_back(Config("generic",ncouplings,100));
+  }
+
+  std::stringstream json;
+  json << std::setprecision(6);
+  json << "{\n  \"precision\": " << RooLagrangianMorphing::implementedPrecision() << ",\n  \"evaluations\": " << nevaluations << ",\n  \"results\": [\n";
+  for(size_t i=0; i<configs.size(); ++i){
+    if(i>0) json << ",\n";
+    runBenchmark(configs[i],nevaluations,json);
+  }
+  json << "\n  ]\n}\n";
+
+  if(outfile.empty()){
+    std::cout << json.str();
+  } else {
+    std::ofstream out(outfile);
+    if(!out.good()){
+      std::cerr << "unable to write to '" << outfile << "'" << std::endl;
+      return 1;
+    }
+    out << json.str();
+  }
+  return 0;
+}